@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2021 Stonyx
+ * https://www.stonyx.com/
+ *
+ * This driver is free software. You can redistribute it and/or modify it under the terms of the
+ * GNU General Public License Version 3 (or at your option any later version) as published by The
+ * Free Software Foundation.
+ *
+ * This driver is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * If you did not received a copy of the GNU General Public License along with this script see
+ * http://www.gnu.org/copyleft/gpl.html or write to The Free Software Foundation, 675 Mass Ave,
+ * Cambridge, MA 02139, USA.
+ */
+
+/*
+ * This library replays the libuLinux_hal library function calls recorded in a trace file by the
+ * helper program (when run with the --trace argument) instead of accessing the embedded controller.
+ *
+ * Every call returns the value and return value of the next recorded call of the same function
+ * for the same channel and starts over with the first recorded call once all recorded calls have
+ * been replayed, calls for channels that were never recorded return -1 like calls for unknown
+ * channels do, and calls to set the fan PWM value return the recorded return value without
+ * changing the replayed fan PWM values.
+ *
+ * The trace file path and the replay speed can be set with the following environment variables:
+ *
+ * QNAP_EC_REPLAY_TRACE  trace file path (default /etc/qnap-ec.trace)
+ * QNAP_EC_REPLAY_SPEED  recorded call duration divisor or 0 to return right away (default 0)
+ *
+ * The position in the trace is kept per process so every helper program started by the kernel
+ * module starts replaying from the beginning of the trace while a helper program running as a
+ * daemon replays the whole trace.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "qnap-ec-ioctl.h"
+#include "qnap-ec-trace.h"
+
+// Define the default trace file path
+#define QNAP_EC_REPLAY_TRACE_FILE "/etc/qnap-ec.trace"
+
+// Declare functions
+static struct qnap_ec_trace_record* qnap_ec_replay_get_record(uint8_t function, uint8_t channel);
+static void qnap_ec_replay_load_trace(void);
+
+// Define the trace loaded flag, the replay speed, the trace records, the record indexes sorted by
+//   function and channel, and the first record index position, number of records, and next record
+//   count indexed by function and channel
+static int qnap_ec_replay_loaded;
+static double qnap_ec_replay_speed;
+static struct qnap_ec_trace_record* qnap_ec_replay_records;
+static uint32_t* qnap_ec_replay_indexes;
+static uint32_t qnap_ec_replay_firsts[number_of_funcs][256];
+static uint32_t qnap_ec_replay_counts[number_of_funcs][256];
+static uint32_t qnap_ec_replay_nexts[number_of_funcs][256];
+
+int8_t ec_sys_get_fan_status(uint8_t channel, uint32_t* status)
+{
+  // Declare needed variables
+  struct qnap_ec_trace_record* record;
+
+  // Get the next recorded call and set the status
+  record = qnap_ec_replay_get_record(func_ec_sys_get_fan_status, channel);
+  if (record == NULL)
+  {
+    *status = 0;
+    return -1;
+  }
+  *status = (uint32_t)record->value;
+
+  return record->return_value;
+}
+
+int8_t ec_sys_get_fan_speed(uint8_t channel, uint32_t* speed)
+{
+  // Declare needed variables
+  struct qnap_ec_trace_record* record;
+
+  // Get the next recorded call and set the speed
+  record = qnap_ec_replay_get_record(func_ec_sys_get_fan_speed, channel);
+  if (record == NULL)
+  {
+    *speed = 0;
+    return -1;
+  }
+  *speed = (uint32_t)record->value;
+
+  return record->return_value;
+}
+
+int8_t ec_sys_get_fan_pwm(uint8_t channel, uint32_t* pwm)
+{
+  // Declare needed variables
+  struct qnap_ec_trace_record* record;
+
+  // Get the next recorded call and set the fan PWM value
+  record = qnap_ec_replay_get_record(func_ec_sys_get_fan_pwm, channel);
+  if (record == NULL)
+  {
+    *pwm = 0;
+    return -1;
+  }
+  *pwm = (uint32_t)record->value;
+
+  return record->return_value;
+}
+
+int8_t ec_sys_get_temperature(uint8_t channel, double* temperature)
+{
+  // Declare needed variables
+  struct qnap_ec_trace_record* record;
+
+  // Get the next recorded call and set the temperature
+  // Note: the recorded temperature is multiplied by 1000 (see the qnap-ec-trace.h file)
+  record = qnap_ec_replay_get_record(func_ec_sys_get_temperature, channel);
+  if (record == NULL)
+  {
+    *temperature = 0;
+    return -1;
+  }
+  *temperature = (double)record->value / 1000;
+
+  return record->return_value;
+}
+
+int8_t ec_sys_set_fan_speed(uint8_t channel, uint8_t pwm)
+{
+  // Declare needed variables
+  struct qnap_ec_trace_record* record;
+
+  // Get the next recorded call
+  // Note: the fan PWM value is ignored since the replayed fan PWM values can't change
+  (void)pwm;
+  record = qnap_ec_replay_get_record(func_ec_sys_set_fan_speed, channel);
+  if (record == NULL)
+    return -1;
+
+  return record->return_value;
+}
+
+// Function called to get the next recorded call of a function for a channel and to wait for the
+//   recorded call's duration divided by the replay speed
+static struct qnap_ec_trace_record* qnap_ec_replay_get_record(uint8_t function, uint8_t channel)
+{
+  // Declare needed variables
+  double duration;
+  struct timespec wait;
+  struct qnap_ec_trace_record* record;
+
+  // Check if this is the first call and load the trace
+  if (!qnap_ec_replay_loaded)
+    qnap_ec_replay_load_trace();
+
+  // Check if there are no recorded calls of this function for this channel
+  if (qnap_ec_replay_counts[function][channel] == 0)
+    return NULL;
+
+  // Get the next recorded call and advance the next record count
+  record = &qnap_ec_replay_records[qnap_ec_replay_indexes[qnap_ec_replay_firsts[function][channel] +
+    qnap_ec_replay_nexts[function][channel] % qnap_ec_replay_counts[function][channel]]];
+  ++qnap_ec_replay_nexts[function][channel];
+
+  // Check if we need to wait for the recorded call's duration and wait for it
+  if (qnap_ec_replay_speed > 0)
+  {
+    duration = record->duration / qnap_ec_replay_speed;
+    wait.tv_sec = (time_t)(duration / 1000000000);
+    wait.tv_nsec = (long)(duration - wait.tv_sec * 1000000000.0);
+    while (nanosleep(&wait, &wait) != 0)
+      ;
+  }
+
+  return record;
+}
+
+// Function called to load the trace file and sort the record indexes by function and channel
+// Note: if the trace file can't be loaded no calls are replayed and every call returns -1
+static void qnap_ec_replay_load_trace(void)
+{
+  // Declare needed variables
+  uint32_t i;
+  uint32_t number_of_records;
+  int file;
+  char* value;
+  struct stat file_stat;
+  struct qnap_ec_trace_header header;
+
+  // Set the trace loaded flag and get the replay speed
+  qnap_ec_replay_loaded = 1;
+  value = getenv("QNAP_EC_REPLAY_SPEED");
+  if (value != NULL)
+    qnap_ec_replay_speed = strtod(value, NULL);
+
+  // Open the trace file and check the header
+  value = getenv("QNAP_EC_REPLAY_TRACE");
+  file = open(value != NULL ? value : QNAP_EC_REPLAY_TRACE_FILE, O_RDONLY | O_CLOEXEC);
+  if (file < 0)
+    return;
+  if (fstat(file, &file_stat) != 0 || read(file, &header, sizeof(header)) != sizeof(header) ||
+      header.magic != QNAP_EC_TRACE_MAGIC || header.version != QNAP_EC_TRACE_VERSION)
+  {
+    close(file);
+    return;
+  }
+
+  // Read the records
+  number_of_records = (file_stat.st_size - sizeof(header)) / sizeof(struct qnap_ec_trace_record);
+  qnap_ec_replay_records = malloc(number_of_records * sizeof(struct qnap_ec_trace_record));
+  qnap_ec_replay_indexes = malloc(number_of_records * sizeof(uint32_t));
+  if (qnap_ec_replay_records == NULL || qnap_ec_replay_indexes == NULL ||
+      read(file, qnap_ec_replay_records, number_of_records * sizeof(struct qnap_ec_trace_record)) !=
+      (ssize_t)(number_of_records * sizeof(struct qnap_ec_trace_record)))
+  {
+    free(qnap_ec_replay_records);
+    free(qnap_ec_replay_indexes);
+    qnap_ec_replay_records = NULL;
+    qnap_ec_replay_indexes = NULL;
+    close(file);
+    return;
+  }
+  close(file);
+
+  // Count the records of each function for each channel ignoring records of unknown functions
+  for (i = 0; i < number_of_records; ++i)
+    if (qnap_ec_replay_records[i].function < number_of_funcs)
+      ++qnap_ec_replay_counts[qnap_ec_replay_records[i].function]
+        [qnap_ec_replay_records[i].channel];
+
+  // Set the first record index positions and sort the record indexes by function and channel while
+  //   keeping the recorded order within each function and channel
+  // Note: the next record counts are used as temporary fill counts and are reset afterwards
+  for (i = 1; i < number_of_funcs * 256; ++i)
+    qnap_ec_replay_firsts[i / 256][i % 256] = qnap_ec_replay_firsts[(i - 1) / 256][(i - 1) % 256] +
+      qnap_ec_replay_counts[(i - 1) / 256][(i - 1) % 256];
+  for (i = 0; i < number_of_records; ++i)
+    if (qnap_ec_replay_records[i].function < number_of_funcs)
+      qnap_ec_replay_indexes[qnap_ec_replay_firsts[qnap_ec_replay_records[i].function]
+        [qnap_ec_replay_records[i].channel] + qnap_ec_replay_nexts[qnap_ec_replay_records[i].
+        function][qnap_ec_replay_records[i].channel]++] = i;
+  memset(qnap_ec_replay_nexts, 0, sizeof(qnap_ec_replay_nexts));
+}
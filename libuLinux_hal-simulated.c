@@ -316,245 +316,936 @@
  * returned = 0, argument 1 after call = 38, argument 2 after call = -1.000000
  */
 
+/*
+ * The values shown above are built into this simulation as the default profile and a profile for
+ * a different model can be loaded from a profile file (see the profiles directory) which lists the
+ * return value and value of every function for every channel of that model.
+ *
+ * On top of the profile values this simulation models the fans and temperature sensors that
+ * actually exist on the profiled model (fans whose speed and fan PWM value are both valid and
+ * temperature sensors whose temperature is above zero, which on a TS-673A unit are fans 0, 1, and
+ * 6 and temperature sensors 0, 5, 6, and 7) as a simple physical system:
+ *
+ * - setting a fan PWM value changes the fan PWM value of every channel in the same fan PWM group
+ *   (adjacent channels with the same fan PWM value in the profile which on a TS-673A unit are
+ *   channels 0 through 5, 6 through 7, 20 through 25, and 30 through 35)
+ * - each fan's speed follows its fan PWM value with a configurable inertia (time constant)
+ * - each temperature follows an equilibrium temperature that depends on the ambient temperature,
+ *   a synthetic heat load, and the amount of air moved by the fans with a configurable inertia
+ * - fan speed noise comes from a pseudo random number generator seeded from the configuration so
+ *   runs are reproducible and simulated time can advance by a fixed step per call instead of
+ *   following the real time so that runs are fully deterministic
+ *
+ * Because the helper program is started as a new process for every batch of calls the simulation
+ * state is kept in a small memory mapped state file which is shared by all the processes using
+ * this library and locked while a call is being simulated.  The state file is only readable and
+ * writable by its owner and it is only used if it is a regular file (not a symbolic link) owned by
+ * the user running the process so a state file created by another user is ignored.
+ *
+ * The configuration is read from /etc/qnap-ec-sim.conf (or from the file named by the
+ * QNAP_EC_SIM_CONFIG environment variable) which contains one key = value pair per line with the
+ * following keys (lines starting with # are ignored):
+ *
+ * seed                 pseudo random number generator seed (default 1)
+ * fan_inertia_ms       fan speed time constant in milliseconds (default 2000)
+ * thermal_inertia_ms   temperature time constant in milliseconds (default 30000)
+ * ambient_temperature  ambient temperature in degrees Celsius (default 20)
+ * heat_load            heat load multiplier (default 1)
+ * fan_noise            maximum fan speed noise in RPM (default 5)
+ * time_step_ms         simulated time per call in milliseconds or 0 to use the real time
+ *                      (default 0)
+ * state_file           state file path (default /dev/shm/qnap-ec-sim.state)
+ * profile              profile file path or nothing to use the built in TS-673A profile
+ *                      (default nothing)
+ *
+ * To simulate a slow and unreliable embedded controller the following keys set the latency and
+ * the fault rates of every function or, when prefixed with a function name and a period (for
+ * example ec_sys_get_fan_speed.error_rate), of only that function (keys are applied in the order
+ * they appear in the file so function specific keys should follow the keys for every function):
+ *
+ * latency_ms           minimum time a call takes in milliseconds (default 0)
+ * latency_jitter_ms    maximum random time added to a call in milliseconds (default 0)
+ * latency_spike_ms     time added to a call when a latency spike happens in milliseconds
+ *                      (default 0)
+ * latency_spike_rate   probability of a latency spike between 0 and 1 (default 0)
+ * error_rate           probability of a call returning -1 between 0 and 1 (default 0)
+ * invalid_rate         probability of a call returning an invalid value between 0 and 1 which is
+ *                      a fan status of 1, a fan speed of 65535, a fan PWM value of 650, a
+ *                      temperature of -128, or a fan PWM value being ignored (default 0)
+ *
+ * The latency and fault decisions are drawn from the same seeded pseudo random number generator
+ * as the fan speed noise so they are also reproducible.
+ *
+ * The state file is reset whenever it was created by an incompatible version of this library, with
+ * a different seed, or with a different profile so changing the seed or the profile (or deleting
+ * the state file) restarts the simulation.
+ */
+
+#include <fcntl.h>
+#include <math.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
+
+// Define the default configuration file and state file paths
+#define QNAP_EC_SIM_CONFIG_FILE "/etc/qnap-ec-sim.conf"
+#define QNAP_EC_SIM_STATE_FILE "/dev/shm/qnap-ec-sim.state"
+
+// Define the state file identification and version values
+#define QNAP_EC_SIM_STATE_MAGIC 0x51454353
+#define QNAP_EC_SIM_STATE_VERSION 2
+
+// Define the simulated functions
+enum qnap_ec_sim_function {
+  qnap_ec_sim_get_fan_status_function,
+  qnap_ec_sim_get_fan_speed_function,
+  qnap_ec_sim_get_fan_pwm_function,
+  qnap_ec_sim_get_temperature_function,
+  qnap_ec_sim_set_fan_speed_function,
+  qnap_ec_sim_number_of_functions
+};
+
+// Define the simulated faults
+enum qnap_ec_sim_fault {
+  qnap_ec_sim_no_fault,
+  qnap_ec_sim_error_fault,
+  qnap_ec_sim_invalid_fault
+};
+
+// Define the number of channels and the maximum number of modeled fan PWM groups, fans, and
+//   temperature sensors
+#define QNAP_EC_SIM_NUMBER_OF_CHANNELS 64
+#define QNAP_EC_SIM_MAX_PWM_GROUPS 16
+#define QNAP_EC_SIM_MAX_FANS 16
+#define QNAP_EC_SIM_MAX_TEMPS 16
+
+// Define the ambient temperature the profiles are assumed to be recorded at
+#define QNAP_EC_SIM_PROFILE_AMBIENT_TEMPERATURE 20
+
+// Define the profile channel structure
+struct qnap_ec_sim_profile_channel {
+  int8_t status_return_value;
+  uint32_t status;
+  int8_t speed_return_value;
+  uint32_t speed;
+  int8_t pwm_return_value;
+  uint32_t pwm;
+  int8_t temperature_return_value;
+  double temperature;
+};
+
+// Define the function fault configuration structure
+// Note: times are in milliseconds and rates are probabilities between 0 and 1
+struct qnap_ec_sim_fault_config {
+  double latency;
+  double latency_jitter;
+  double latency_spike;
+  double latency_spike_rate;
+  double error_rate;
+  double invalid_rate;
+};
+
+// Define the configuration structure
+struct qnap_ec_sim_config {
+  uint64_t seed;
+  double fan_inertia;
+  double thermal_inertia;
+  double ambient_temperature;
+  double heat_load;
+  double fan_noise;
+  double time_step;
+  char state_file[256];
+  char profile[256];
+  struct qnap_ec_sim_fault_config faults[qnap_ec_sim_number_of_functions];
+};
+
+// Define the state structure
+// Note: times are in nanoseconds and the real time is the monotonic clock time of the last call
+//       which is the same for all processes
+struct qnap_ec_sim_state {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t seed;
+  uint32_t profile_checksum;
+  uint64_t random_state;
+  int64_t time;
+  int64_t real_time;
+  double pwms[QNAP_EC_SIM_MAX_PWM_GROUPS];
+  double speeds[QNAP_EC_SIM_MAX_FANS];
+  double temperatures[QNAP_EC_SIM_MAX_TEMPS];
+};
+
+// Define the simulated function names indexed by simulated function
+static const char* qnap_ec_sim_function_names[] = {
+  [qnap_ec_sim_get_fan_status_function] = "ec_sys_get_fan_status",
+  [qnap_ec_sim_get_fan_speed_function] = "ec_sys_get_fan_speed",
+  [qnap_ec_sim_get_fan_pwm_function] = "ec_sys_get_fan_pwm",
+  [qnap_ec_sim_get_temperature_function] = "ec_sys_get_temperature",
+  [qnap_ec_sim_set_fan_speed_function] = "ec_sys_set_fan_speed"
+};
+
+// Define the built in TS-673A profile indexed by channel
+// Note: channels that are not listed return -1 for every function
+static const struct qnap_ec_sim_profile_channel qnap_ec_sim_default_profile[] = {
+  [0] = { 0, 0, 0, 666, 0, 80, 0, 29 },
+  [1] = { 0, 0, 0, 661, 0, 80, 0, -1 },
+  [2] = { 0, 1, 0, 65535, 0, 80, -1, 0 },
+  [3] = { 0, 1, 0, 65535, 0, 80, -1, 0 },
+  [4] = { 0, 1, 0, 65535, 0, 80, -1, 0 },
+  [5] = { 0, 1, 0, 65535, 0, 80, 0, 23 },
+  [6] = { 0, 0, 0, 891, 0, 90, 0, 25 },
+  [7] = { 0, 1, 0, 65535, 0, 90, 0, 30 },
+  [8] = { -1, 0, -1, 0, -1, 0, -1, 0 },
+  [9] = { -1, 0, -1, 0, -1, 0, -1, 0 },
+  [10] = { 0, 0, 0, -2, -1, 0, 0, -2 },
+  [11] = { 0, 0, 0, -2, -1, 0, 0, -2 },
+  [12] = { -1, 0, -1, 0, -1, 0, -1, 0 },
+  [13] = { -1, 0, -1, 0, -1, 0, -1, 0 },
+  [14] = { -1, 0, -1, 0, -1, 0, -1, 0 },
+  [15] = { -1, 0, -1, 0, -1, 0, 0, -128 },
+  [16] = { -1, 0, -1, 0, -1, 0, 0, -1 },
+  [17] = { -1, 0, -1, 0, -1, 0, 0, -1 },
+  [18] = { -1, 0, -1, 0, -1, 0, 0, -1 },
+  [19] = { -1, 0, -1, 0, -1, 0, 0, -1 },
+  [20] = { 0, 0, 0, 65535, 0, 100, 0, -1 },
+  [21] = { 0, 0, 0, 65535, 0, 100, 0, -1 },
+  [22] = { 0, 0, 0, 65535, 0, 100, 0, -1 },
+  [23] = { 0, 0, 0, 65535, 0, 100, 0, -1 },
+  [24] = { 0, 0, 0, 65535, 0, 100, 0, -1 },
+  [25] = { 0, 0, 0, 65535, 0, 100, 0, -1 },
+  [26] = { -1, 0, -1, 0, -1, 0, 0, -1 },
+  [27] = { -1, 0, -1, 0, -1, 0, 0, -1 },
+  [28] = { -1, 0, -1, 0, -1, 0, 0, -1 },
+  [29] = { -1, 0, -1, 0, -1, 0, 0, -1 },
+  [30] = { 0, 0, 0, 65535, 0, 650, 0, -1 },
+  [31] = { 0, 0, 0, 65535, 0, 650, 0, -1 },
+  [32] = { 0, 0, 0, 65535, 0, 650, 0, -1 },
+  [33] = { 0, 0, 0, 4976, 0, 650, 0, -1 },
+  [34] = { 0, 0, 0, 12096, 0, 650, 0, -1 },
+  [35] = { 0, 0, 0, 65535, 0, 650, 0, -1 },
+  [36] = { -1, 0, -1, 0, -1, 0, 0, -1 },
+  [37] = { -1, 0, -1, 0, -1, 0, 0, -1 },
+  [38] = { -1, 0, -1, 0, -1, 0, 0, -1 }
+};
+
+// Declare functions
+static struct qnap_ec_sim_state* qnap_ec_sim_lock_state(void);
+static void qnap_ec_sim_unlock_state(void);
+static void qnap_ec_sim_init(void);
+static void qnap_ec_sim_read_config(void);
+static void qnap_ec_sim_load_profile(void);
+static void qnap_ec_sim_read_profile(void);
+static void qnap_ec_sim_set_fault_config(struct qnap_ec_sim_fault_config* fault_config, char* key,
+                                         double value);
+static enum qnap_ec_sim_fault qnap_ec_sim_get_fault(struct qnap_ec_sim_state* state,
+                                                    enum qnap_ec_sim_function function);
+static void qnap_ec_sim_reset_state(struct qnap_ec_sim_state* state);
+static void qnap_ec_sim_advance_state(struct qnap_ec_sim_state* state);
+static double qnap_ec_sim_get_airflow(struct qnap_ec_sim_state* state);
+static double qnap_ec_sim_get_random(struct qnap_ec_sim_state* state);
+static const struct qnap_ec_sim_profile_channel* qnap_ec_sim_get_profile_channel(uint8_t channel);
+static int8_t qnap_ec_sim_get_pwm_group(uint8_t channel);
+static int8_t qnap_ec_sim_get_fan(uint8_t channel);
+static int8_t qnap_ec_sim_get_temp(uint8_t channel);
+
+// Define the configuration, the state file descriptor, the process local state used if the state
+//   file can't be used, and the latency of the current call
+static struct qnap_ec_sim_config qnap_ec_sim_config;
+static double qnap_ec_sim_latency;
+static int qnap_ec_sim_state_file = -1;
+static struct qnap_ec_sim_state* qnap_ec_sim_state;
+static struct qnap_ec_sim_state qnap_ec_sim_local_state;
+
+// Define the initialized flag, the profile, and the fan PWM group, modeled fan, and modeled
+//   temperature sensor (or -1) indexed by channel
+static int qnap_ec_sim_initialized;
+static struct qnap_ec_sim_profile_channel qnap_ec_sim_profile[QNAP_EC_SIM_NUMBER_OF_CHANNELS];
+static int8_t qnap_ec_sim_channel_pwm_groups[QNAP_EC_SIM_NUMBER_OF_CHANNELS];
+static int8_t qnap_ec_sim_channel_fans[QNAP_EC_SIM_NUMBER_OF_CHANNELS];
+static int8_t qnap_ec_sim_channel_temps[QNAP_EC_SIM_NUMBER_OF_CHANNELS];
+
+// Define the number of modeled fan PWM groups, fans, and temperature sensors, the initial fan PWM
+//   values indexed by fan PWM group, the fan PWM groups and the RPM per fan PWM unit values indexed
+//   by fan, the heat loads (in degrees Celsius above the ambient temperature at the initial fan
+//   speeds) indexed by temperature sensor, and the profile checksum
+// Note: these values are derived from the profile so that the initial state matches the profile
+static uint8_t qnap_ec_sim_number_of_pwm_groups;
+static uint8_t qnap_ec_sim_number_of_fans;
+static uint8_t qnap_ec_sim_number_of_temps;
+static double qnap_ec_sim_initial_pwms[QNAP_EC_SIM_MAX_PWM_GROUPS];
+static uint8_t qnap_ec_sim_fan_pwm_groups[QNAP_EC_SIM_MAX_FANS];
+static double qnap_ec_sim_fan_rpm_per_pwm[QNAP_EC_SIM_MAX_FANS];
+static double qnap_ec_sim_temp_heat_loads[QNAP_EC_SIM_MAX_TEMPS];
+static uint32_t qnap_ec_sim_profile_checksum;
 
 int8_t ec_sys_get_fan_status(uint8_t channel, uint32_t* status)
 {
-  switch (channel)
+  // Declare needed variables
+  int8_t return_value = 0;
+  enum qnap_ec_sim_fault fault;
+  struct qnap_ec_sim_state* state;
+  const struct qnap_ec_sim_profile_channel* profile_channel;
+
+  // Get the channel's profile values and check if the status can't be read for this channel
+  profile_channel = qnap_ec_sim_get_profile_channel(channel);
+  if (profile_channel->status_return_value != 0)
+  {
+    *status = profile_channel->status;
+    return profile_channel->status_return_value;
+  }
+
+  // Get the simulation state and the simulated fault and set the status
+  state = qnap_ec_sim_lock_state();
+  fault = qnap_ec_sim_get_fault(state, qnap_ec_sim_get_fan_status_function);
+  *status = profile_channel->status;
+  if (fault == qnap_ec_sim_invalid_fault)
+    *status = 1;
+  if (fault == qnap_ec_sim_error_fault)
   {
-    case 0:
-    case 1:
-      *status = 0;
-      return 0;
-    case 2:
-    case 3:
-    case 4:
-    case 5:
-      *status = 1;
-      return 0;
-    case 6:
-      *status = 0;
-      return 0;
-    case 7:
-      *status = 1;
-      return 0;
-    case 10:
-    case 11:
-      *status = 0;
-      return 0;
-    case 20:
-    case 21:
-    case 22:
-    case 23:
-    case 24:
-    case 25:
-      *status = 0;
-      return 0;
-    case 30:
-    case 31:
-    case 32:
-    case 33:
-    case 34:
-    case 35:
-      *status = 0;
-      return 0;
-    default:
-      *status = 0;
-      return -1;
+    *status = 0;
+    return_value = -1;
   }
+  qnap_ec_sim_unlock_state();
+
+  return return_value;
 }
 
 int8_t ec_sys_get_fan_speed(uint8_t channel, uint32_t* speed)
 {
-  switch (channel)
+  // Declare needed variables
+  int8_t fan;
+  int8_t return_value = 0;
+  double value;
+  enum qnap_ec_sim_fault fault;
+  struct qnap_ec_sim_state* state;
+  const struct qnap_ec_sim_profile_channel* profile_channel;
+
+  // Get the channel's profile values and check if the speed can't be read for this channel
+  profile_channel = qnap_ec_sim_get_profile_channel(channel);
+  if (profile_channel->speed_return_value != 0)
+  {
+    *speed = profile_channel->speed;
+    return profile_channel->speed_return_value;
+  }
+
+  // Get the simulation state and the simulated fault and set the speed
+  state = qnap_ec_sim_lock_state();
+  fault = qnap_ec_sim_get_fault(state, qnap_ec_sim_get_fan_speed_function);
+  fan = qnap_ec_sim_get_fan(channel);
+  if (fan >= 0)
   {
-    case 0:
-      // Set speed to a random number between 650 and 660
-      srand(time(NULL) + 1);
-      *speed = rand() % (660 + 1 - 650) + 650;
-      return 0;
-    case 1:
-      // Set speed to a random number between 650 and 660
-      srand(time(NULL) + 2);
-      *speed = rand() % (660 + 1 - 650) + 650;
-      return 0;
-    case 2:
-    case 3:
-    case 4:
-    case 5:
-      *speed = 65535;
-      return 0;
-    case 6:
-      // Set speed to a random number between 890 and 900
-      srand(time(NULL) + 3);
-      *speed = rand() % (900 + 1 - 890) + 890;
-      return 0;
-    case 7:
-      *speed = 65535;
-      return 0;
-    case 10:
-    case 11:
-      *speed = -2;
-      return 0;
-    case 20:
-    case 21:
-    case 22:
-    case 23:
-    case 24:
-    case 25:
-      *speed = 65535;
-      return 0;
-    case 30:
-    case 31:
-    case 32:
-      *speed = 65535;
-      return 0;      
-    case 33:
-      *speed = 4976;
-      return 0;
-    case 34:
-      *speed = 12096;
-      return 0;
-    case 35:
-      *speed = 65535;
-      return 0;
-    default:
-      *speed = 0;
-      return -1;
+    // Set the speed to the modeled speed plus noise
+    value = state->speeds[fan] + qnap_ec_sim_get_random(state) * qnap_ec_sim_config.fan_noise;
+    *speed = value > 0 ? (uint32_t)lround(value) : 0;
   }
+  else
+  {
+    *speed = profile_channel->speed;
+  }
+  if (fault == qnap_ec_sim_invalid_fault)
+    *speed = 65535;
+  if (fault == qnap_ec_sim_error_fault)
+  {
+    *speed = 0;
+    return_value = -1;
+  }
+  qnap_ec_sim_unlock_state();
+
+  return return_value;
 }
 
 int8_t ec_sys_get_fan_pwm(uint8_t channel, uint32_t* pwm)
 {
-  switch (channel)
+  // Declare needed variables
+  int8_t group;
+  int8_t return_value = 0;
+  enum qnap_ec_sim_fault fault;
+  struct qnap_ec_sim_state* state;
+  const struct qnap_ec_sim_profile_channel* profile_channel;
+
+  // Get the channel's profile values and check if this channel is not part of a fan PWM group
+  profile_channel = qnap_ec_sim_get_profile_channel(channel);
+  group = qnap_ec_sim_get_pwm_group(channel);
+  if (group < 0)
+  {
+    *pwm = profile_channel->pwm;
+    return profile_channel->pwm_return_value;
+  }
+
+  // Get the simulation state and the simulated fault and set the fan PWM to the fan PWM group's
+  //   value
+  state = qnap_ec_sim_lock_state();
+  fault = qnap_ec_sim_get_fault(state, qnap_ec_sim_get_fan_pwm_function);
+  *pwm = (uint32_t)state->pwms[group];
+  if (fault == qnap_ec_sim_invalid_fault)
+    *pwm = 650;
+  if (fault == qnap_ec_sim_error_fault)
   {
-    case 0:
-    case 1:
-    case 2:
-    case 3:
-    case 4:
-    case 5:
-      *pwm = 80;
-      return 0;
-    case 6:
-    case 7:
-      *pwm = 90;
-      return 0;
-    case 20:
-    case 21:
-    case 22:
-    case 23:
-    case 24:
-    case 25:
-      *pwm = 100;
-      return 0;
-    case 30:
-    case 31:
-    case 32:
-    case 33:
-    case 34:
-    case 35:
-      *pwm = 650;
-      return 0;
-    default:
-      *pwm = 0;
-      return -1;
+    *pwm = 0;
+    return_value = -1;
   }
+  qnap_ec_sim_unlock_state();
+
+  return return_value;
 }
 
 int8_t ec_sys_get_temperature(uint8_t channel, double* temperature)
 {
-  switch (channel)
+  // Declare needed variables
+  int8_t temp;
+  int8_t return_value = 0;
+  enum qnap_ec_sim_fault fault;
+  struct qnap_ec_sim_state* state;
+  const struct qnap_ec_sim_profile_channel* profile_channel;
+
+  // Get the channel's profile values and check if the temperature can't be read for this channel
+  profile_channel = qnap_ec_sim_get_profile_channel(channel);
+  if (profile_channel->temperature_return_value != 0)
+  {
+    *temperature = profile_channel->temperature;
+    return profile_channel->temperature_return_value;
+  }
+
+  // Get the simulation state and the simulated fault and set the temperature
+  state = qnap_ec_sim_lock_state();
+  fault = qnap_ec_sim_get_fault(state, qnap_ec_sim_get_temperature_function);
+  temp = qnap_ec_sim_get_temp(channel);
+  if (temp >= 0)
+  {
+    // Set the temperature to the modeled temperature rounded to whole degrees like the real
+    //   temperature sensors
+    *temperature = round(state->temperatures[temp]);
+  }
+  else
   {
-    case 0:
-      // Set temperature to a random number between 28 and 30
-      srand(time(NULL) + 4);
-      *temperature = rand() % (30 + 1 - 28) + 28;
-      return 0;
-    case 1:
-      *temperature = -1;
-      return 0;
-    case 5:
-      // Set temperature to a random number between 23 and 25
-      srand(time(NULL) + 5);
-      *temperature = rand() % (25 + 1 - 23) + 23;
-      return 0;
-    case 6:
-      // Set temperature to a random number between 23 and 25
-      srand(time(NULL) + 6);
-      *temperature = rand() % (25 + 1 - 23) + 23;
-      return 0;
-    case 7:
-      // Set temperature to a random number between 28 and 30
-      srand(time(NULL) + 7);
-      *temperature = rand() % (30 + 1 - 28) + 28;
-      return 0;
-    case 10:
-    case 11:
-      *temperature = -2;
-      return 0;
-    case 15:
-      *temperature = -128;
-      return 0;
-    case 16:
-    case 17:
-    case 18:
-    case 19:
-    case 20:
-    case 21:
-    case 22:
-    case 23:
-    case 24:
-    case 25:
-    case 26:
-    case 27:
-    case 28:
-    case 29:
-    case 30:
-    case 31:
-    case 32:
-    case 33:
-    case 34:
-    case 35:
-    case 36:
-    case 37:
-    case 38:
-      *temperature = -1;
-      return 0;
-    default:
-      *temperature = 0;
-      return -1;
+    *temperature = profile_channel->temperature;
   }
+  if (fault == qnap_ec_sim_invalid_fault)
+    *temperature = -128;
+  if (fault == qnap_ec_sim_error_fault)
+  {
+    *temperature = 0;
+    return_value = -1;
+  }
+  qnap_ec_sim_unlock_state();
+
+  return return_value;
 }
 
 int8_t ec_sys_set_fan_speed(uint8_t channel, uint8_t pwm)
 {
-  switch (channel)
+  // Declare needed variables
+  int8_t group;
+  int8_t return_value = 0;
+  enum qnap_ec_sim_fault fault;
+  struct qnap_ec_sim_state* state;
+
+  // Make sure the profile is loaded and check if this channel is not part of a fan PWM group
+  qnap_ec_sim_init();
+  group = qnap_ec_sim_get_pwm_group(channel);
+  if (group < 0)
+    return -1;
+
+  // Get the simulation state and the simulated fault and set the fan PWM group's value unless the
+  //   fault is an ignored value
+  // Note: the fans follow the new value gradually as the simulated time advances
+  state = qnap_ec_sim_lock_state();
+  fault = qnap_ec_sim_get_fault(state, qnap_ec_sim_set_fan_speed_function);
+  if (fault == qnap_ec_sim_no_fault)
+    state->pwms[group] = pwm;
+  if (fault == qnap_ec_sim_error_fault)
+    return_value = -1;
+  qnap_ec_sim_unlock_state();
+
+  return return_value;
+}
+
+// Function called to get the simulation state locked for exclusive use and advanced to the current
+//   simulated time
+// Note: the configuration is read and the state file is opened and mapped the first time this
+//       function is called and if the state file can't be used a process local state is used
+static struct qnap_ec_sim_state* qnap_ec_sim_lock_state(void)
+{
+  // Declare needed variables
+  void* memory;
+  struct stat file_stat;
+
+  // Check if this is the first call
+  if (qnap_ec_sim_state == NULL)
   {
-    case 0:
-    case 1:
-    case 2:
-    case 3:
-    case 4:
-    case 5:
-    case 6:
-    case 7:
-    case 20:
-    case 21:
-    case 22:
-    case 23:
-    case 24:
-    case 25:
-    case 30:
-    case 31:
-    case 32:
-    case 33:
-    case 34:
-    case 35:
-      return 0;
-    default:
-      return -1;
+    // Read the configuration and load the profile
+    qnap_ec_sim_init();
+
+    // Open the state file, make sure it's a regular file owned by this user and large enough, and
+    //   map it into memory
+    // Note: the state file is usually located in a world writable directory so it's not followed if
+    //       it's a symbolic link and it's not used if it was created by another user
+    qnap_ec_sim_state = &qnap_ec_sim_local_state;
+    qnap_ec_sim_state_file = open(qnap_ec_sim_config.state_file,
+      O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (qnap_ec_sim_state_file >= 0)
+    {
+      memory = MAP_FAILED;
+      if (fstat(qnap_ec_sim_state_file, &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+          file_stat.st_uid == geteuid() && flock(qnap_ec_sim_state_file, LOCK_EX) == 0)
+      {
+        if (lseek(qnap_ec_sim_state_file, 0, SEEK_END) >= (off_t)sizeof(struct qnap_ec_sim_state) ||
+            ftruncate(qnap_ec_sim_state_file, sizeof(struct qnap_ec_sim_state)) == 0)
+          memory = mmap(NULL, sizeof(struct qnap_ec_sim_state), PROT_READ | PROT_WRITE, MAP_SHARED,
+            qnap_ec_sim_state_file, 0);
+        flock(qnap_ec_sim_state_file, LOCK_UN);
+      }
+      if (memory != MAP_FAILED)
+      {
+        qnap_ec_sim_state = memory;
+      }
+      else
+      {
+        close(qnap_ec_sim_state_file);
+        qnap_ec_sim_state_file = -1;
+      }
+    }
+  }
+
+  // Lock the state file
+  if (qnap_ec_sim_state_file >= 0)
+    flock(qnap_ec_sim_state_file, LOCK_EX);
+
+  // Check if the state was not created by this version of the library with this seed and profile
+  //   and reset it
+  if (qnap_ec_sim_state->magic != QNAP_EC_SIM_STATE_MAGIC ||
+      qnap_ec_sim_state->version != QNAP_EC_SIM_STATE_VERSION ||
+      qnap_ec_sim_state->seed != qnap_ec_sim_config.seed ||
+      qnap_ec_sim_state->profile_checksum != qnap_ec_sim_profile_checksum)
+    qnap_ec_sim_reset_state(qnap_ec_sim_state);
+
+  // Advance the state to the current simulated time
+  qnap_ec_sim_advance_state(qnap_ec_sim_state);
+
+  return qnap_ec_sim_state;
+}
+
+// Function called to unlock the simulation state and wait for the latency of the current call
+// Note: the latency is waited for after unlocking the state so that calls made by other processes
+//       are not held up by it
+static void qnap_ec_sim_unlock_state(void)
+{
+  // Declare needed variables
+  struct timespec latency;
+
+  // Unlock the state file
+  if (qnap_ec_sim_state_file >= 0)
+    flock(qnap_ec_sim_state_file, LOCK_UN);
+
+  // Check if the current call has a latency and wait for it
+  if (qnap_ec_sim_latency > 0)
+  {
+    latency.tv_sec = (time_t)(qnap_ec_sim_latency / 1000);
+    latency.tv_nsec = (long)((qnap_ec_sim_latency - latency.tv_sec * 1000.0) * 1000000);
+    while (nanosleep(&latency, &latency) != 0)
+      ;
+    qnap_ec_sim_latency = 0;
   }
-}
\ No newline at end of file
+}
+
+// Function called to read the configuration and load the profile the first time it's called
+static void qnap_ec_sim_init(void)
+{
+  // Check if this is not the first call
+  if (qnap_ec_sim_initialized)
+    return;
+
+  // Read the configuration and load the profile
+  qnap_ec_sim_read_config();
+  qnap_ec_sim_load_profile();
+  qnap_ec_sim_initialized = 1;
+}
+
+// Function called to read the configuration file
+static void qnap_ec_sim_read_config(void)
+{
+  // Declare needed variables
+  uint8_t i;
+  FILE* file;
+  char* path;
+  char* period;
+  char line[512];
+  char key[64];
+  char value[256];
+
+  // Set the default configuration
+  qnap_ec_sim_config.seed = 1;
+  qnap_ec_sim_config.fan_inertia = 2000;
+  qnap_ec_sim_config.thermal_inertia = 30000;
+  qnap_ec_sim_config.ambient_temperature = 20;
+  qnap_ec_sim_config.heat_load = 1;
+  qnap_ec_sim_config.fan_noise = 5;
+  qnap_ec_sim_config.time_step = 0;
+  strcpy(qnap_ec_sim_config.state_file, QNAP_EC_SIM_STATE_FILE);
+
+  // Open the configuration file
+  path = getenv("QNAP_EC_SIM_CONFIG");
+  file = fopen(path != NULL ? path : QNAP_EC_SIM_CONFIG_FILE, "r");
+  if (file == NULL)
+    return;
+
+  // Loop through the lines and parse each key and value pair
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    // Check if the line is a comment or doesn't contain a key and value pair
+    if (sscanf(line, " %63[^#= \t\n] = %255[^\n]", key, value) != 2)
+      continue;
+
+    // Set the configuration value
+    if (strcmp(key, "seed") == 0)
+      qnap_ec_sim_config.seed = strtoull(value, NULL, 0);
+    else if (strcmp(key, "fan_inertia_ms") == 0)
+      qnap_ec_sim_config.fan_inertia = strtod(value, NULL);
+    else if (strcmp(key, "thermal_inertia_ms") == 0)
+      qnap_ec_sim_config.thermal_inertia = strtod(value, NULL);
+    else if (strcmp(key, "ambient_temperature") == 0)
+      qnap_ec_sim_config.ambient_temperature = strtod(value, NULL);
+    else if (strcmp(key, "heat_load") == 0)
+      qnap_ec_sim_config.heat_load = strtod(value, NULL);
+    else if (strcmp(key, "fan_noise") == 0)
+      qnap_ec_sim_config.fan_noise = strtod(value, NULL);
+    else if (strcmp(key, "time_step_ms") == 0)
+      qnap_ec_sim_config.time_step = strtod(value, NULL);
+    else if (strcmp(key, "state_file") == 0)
+      sscanf(value, "%255s", qnap_ec_sim_config.state_file);
+    else if (strcmp(key, "profile") == 0)
+      sscanf(value, "%255s", qnap_ec_sim_config.profile);
+    else if ((period = strchr(key, '.')) == NULL)
+      for (i = 0; i < qnap_ec_sim_number_of_functions; ++i)
+        qnap_ec_sim_set_fault_config(&qnap_ec_sim_config.faults[i], key, strtod(value, NULL));
+    else
+      for (i = 0; i < qnap_ec_sim_number_of_functions; ++i)
+        if (strncmp(key, qnap_ec_sim_function_names[i], period - key) == 0 &&
+            qnap_ec_sim_function_names[i][period - key] == '\0')
+          qnap_ec_sim_set_fault_config(&qnap_ec_sim_config.faults[i], period + 1,
+            strtod(value, NULL));
+  }
+
+  // Close the configuration file
+  fclose(file);
+}
+
+// Function called to load the profile and derive the modeled fan PWM groups, fans, and temperature
+//   sensors from it
+static void qnap_ec_sim_load_profile(void)
+{
+  // Declare needed variables
+  uint8_t channel;
+  int8_t group;
+  const unsigned char* byte;
+
+  // Check if there is a profile file and read it or otherwise copy the built in profile
+  // Note: channels that are not part of the profile return -1 for every function
+  for (channel = 0; channel < QNAP_EC_SIM_NUMBER_OF_CHANNELS; ++channel)
+  {
+    memset(&qnap_ec_sim_profile[channel], 0, sizeof(struct qnap_ec_sim_profile_channel));
+    qnap_ec_sim_profile[channel].status_return_value = -1;
+    qnap_ec_sim_profile[channel].speed_return_value = -1;
+    qnap_ec_sim_profile[channel].pwm_return_value = -1;
+    qnap_ec_sim_profile[channel].temperature_return_value = -1;
+  }
+  if (qnap_ec_sim_config.profile[0] != '\0')
+    qnap_ec_sim_read_profile();
+  else
+    for (channel = 0; channel < sizeof(qnap_ec_sim_default_profile) /
+        sizeof(struct qnap_ec_sim_profile_channel); ++channel)
+      qnap_ec_sim_profile[channel] = qnap_ec_sim_default_profile[channel];
+
+  // Loop through the channels
+  qnap_ec_sim_number_of_pwm_groups = 0;
+  qnap_ec_sim_number_of_fans = 0;
+  qnap_ec_sim_number_of_temps = 0;
+  for (channel = 0; channel < QNAP_EC_SIM_NUMBER_OF_CHANNELS; ++channel)
+  {
+    // Check if the channel has a fan PWM value and add it to the previous channel's fan PWM group
+    //   if that channel has the same fan PWM value or otherwise to a new fan PWM group
+    group = -1;
+    if (qnap_ec_sim_profile[channel].pwm_return_value == 0)
+    {
+      if (channel > 0 && qnap_ec_sim_channel_pwm_groups[channel - 1] >= 0 &&
+          qnap_ec_sim_profile[channel - 1].pwm == qnap_ec_sim_profile[channel].pwm)
+      {
+        group = qnap_ec_sim_channel_pwm_groups[channel - 1];
+      }
+      else if (qnap_ec_sim_number_of_pwm_groups < QNAP_EC_SIM_MAX_PWM_GROUPS)
+      {
+        group = qnap_ec_sim_number_of_pwm_groups++;
+        qnap_ec_sim_initial_pwms[group] = qnap_ec_sim_profile[channel].pwm;
+      }
+    }
+    qnap_ec_sim_channel_pwm_groups[channel] = group;
+
+    // Check if the channel has a valid fan speed and fan PWM value and model it as a fan
+    qnap_ec_sim_channel_fans[channel] = -1;
+    if (group >= 0 && qnap_ec_sim_profile[channel].speed_return_value == 0 &&
+        qnap_ec_sim_profile[channel].speed > 0 && qnap_ec_sim_profile[channel].speed < 65535 &&
+        qnap_ec_sim_profile[channel].pwm > 0 && qnap_ec_sim_profile[channel].pwm <= 255 &&
+        qnap_ec_sim_number_of_fans < QNAP_EC_SIM_MAX_FANS)
+    {
+      qnap_ec_sim_fan_pwm_groups[qnap_ec_sim_number_of_fans] = group;
+      qnap_ec_sim_fan_rpm_per_pwm[qnap_ec_sim_number_of_fans] =
+        (double)qnap_ec_sim_profile[channel].speed / qnap_ec_sim_profile[channel].pwm;
+      qnap_ec_sim_channel_fans[channel] = qnap_ec_sim_number_of_fans++;
+    }
+
+    // Check if the channel has a valid temperature and model it as a temperature sensor
+    qnap_ec_sim_channel_temps[channel] = -1;
+    if (qnap_ec_sim_profile[channel].temperature_return_value == 0 &&
+        qnap_ec_sim_profile[channel].temperature > 0 &&
+        qnap_ec_sim_number_of_temps < QNAP_EC_SIM_MAX_TEMPS)
+    {
+      qnap_ec_sim_temp_heat_loads[qnap_ec_sim_number_of_temps] =
+        qnap_ec_sim_profile[channel].temperature - QNAP_EC_SIM_PROFILE_AMBIENT_TEMPERATURE;
+      qnap_ec_sim_channel_temps[channel] = qnap_ec_sim_number_of_temps++;
+    }
+  }
+
+  // Calculate the profile checksum using the FNV-1a hash
+  qnap_ec_sim_profile_checksum = 2166136261U;
+  for (byte = (const unsigned char*)qnap_ec_sim_profile; byte < (const unsigned char*)
+      (qnap_ec_sim_profile + QNAP_EC_SIM_NUMBER_OF_CHANNELS); ++byte)
+    qnap_ec_sim_profile_checksum = (qnap_ec_sim_profile_checksum ^ *byte) * 16777619U;
+}
+
+// Function called to read the profile file
+// Note: each line lists a channel followed by the return value and the value of the fan status,
+//       fan speed, fan PWM value, and temperature functions and lines that can't be parsed are
+//       skipped
+static void qnap_ec_sim_read_profile(void)
+{
+  // Declare needed variables
+  unsigned int channel;
+  FILE* file;
+  char line[512];
+  struct qnap_ec_sim_profile_channel profile_channel;
+
+  // Open the profile file
+  file = fopen(qnap_ec_sim_config.profile, "r");
+  if (file == NULL)
+    return;
+
+  // Loop through the lines and parse each channel's values
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    memset(&profile_channel, 0, sizeof(profile_channel));
+    if (sscanf(line, " %u %hhd %u %hhd %u %hhd %u %hhd %lf", &channel,
+        &profile_channel.status_return_value, &profile_channel.status,
+        &profile_channel.speed_return_value, &profile_channel.speed,
+        &profile_channel.pwm_return_value, &profile_channel.pwm,
+        &profile_channel.temperature_return_value, &profile_channel.temperature) == 9 &&
+        channel < QNAP_EC_SIM_NUMBER_OF_CHANNELS)
+      qnap_ec_sim_profile[channel] = profile_channel;
+  }
+
+  // Close the profile file
+  fclose(file);
+}
+
+// Function called to set a value in a function fault configuration
+static void qnap_ec_sim_set_fault_config(struct qnap_ec_sim_fault_config* fault_config, char* key,
+                                         double value)
+{
+  if (strcmp(key, "latency_ms") == 0)
+    fault_config->latency = value;
+  else if (strcmp(key, "latency_jitter_ms") == 0)
+    fault_config->latency_jitter = value;
+  else if (strcmp(key, "latency_spike_ms") == 0)
+    fault_config->latency_spike = value;
+  else if (strcmp(key, "latency_spike_rate") == 0)
+    fault_config->latency_spike_rate = value;
+  else if (strcmp(key, "error_rate") == 0)
+    fault_config->error_rate = value;
+  else if (strcmp(key, "invalid_rate") == 0)
+    fault_config->invalid_rate = value;
+}
+
+// Function called to get the simulated fault of a call and set the call's latency
+static enum qnap_ec_sim_fault qnap_ec_sim_get_fault(struct qnap_ec_sim_state* state,
+                                                    enum qnap_ec_sim_function function)
+{
+  // Declare and/or define needed variables
+  double random;
+  struct qnap_ec_sim_fault_config* fault_config = &qnap_ec_sim_config.faults[function];
+
+  // Set the call's latency to the minimum latency plus the jitter plus a possible spike
+  // Note: the pseudo random number generator returns a number between -1 and 1 which is converted
+  //       to a number between 0 and 1
+  qnap_ec_sim_latency = fault_config->latency;
+  if (fault_config->latency_jitter > 0)
+    qnap_ec_sim_latency += (qnap_ec_sim_get_random(state) + 1) / 2 * fault_config->latency_jitter;
+  if (fault_config->latency_spike_rate > 0 &&
+      (qnap_ec_sim_get_random(state) + 1) / 2 < fault_config->latency_spike_rate)
+    qnap_ec_sim_latency += fault_config->latency_spike;
+
+  // Check if the call should return an error or an invalid value
+  if (fault_config->error_rate > 0 || fault_config->invalid_rate > 0)
+  {
+    random = (qnap_ec_sim_get_random(state) + 1) / 2;
+    if (random < fault_config->error_rate)
+      return qnap_ec_sim_error_fault;
+    if (random < fault_config->error_rate + fault_config->invalid_rate)
+      return qnap_ec_sim_invalid_fault;
+  }
+
+  return qnap_ec_sim_no_fault;
+}
+
+// Function called to reset the simulation state to the initial state
+static void qnap_ec_sim_reset_state(struct qnap_ec_sim_state* state)
+{
+  // Declare needed variables
+  uint8_t i;
+  struct timespec now;
+
+  // Set the identification, version, seed, pseudo random number generator state, and times
+  // Note: the pseudo random number generator state can't be zero
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  state->magic = QNAP_EC_SIM_STATE_MAGIC;
+  state->version = QNAP_EC_SIM_STATE_VERSION;
+  state->seed = qnap_ec_sim_config.seed;
+  state->profile_checksum = qnap_ec_sim_profile_checksum;
+  state->random_state = qnap_ec_sim_config.seed != 0 ? qnap_ec_sim_config.seed :
+    0x9E3779B97F4A7C15ULL;
+  state->time = 0;
+  state->real_time = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+  // Set the fan PWM values and the fan speeds to their initial values
+  for (i = 0; i < qnap_ec_sim_number_of_pwm_groups; ++i)
+    state->pwms[i] = qnap_ec_sim_initial_pwms[i];
+  for (i = 0; i < qnap_ec_sim_number_of_fans; ++i)
+    state->speeds[i] = qnap_ec_sim_initial_pwms[qnap_ec_sim_fan_pwm_groups[i]] *
+      qnap_ec_sim_fan_rpm_per_pwm[i];
+
+  // Set the temperatures to their equilibrium temperatures at the initial fan speeds
+  for (i = 0; i < qnap_ec_sim_number_of_temps; ++i)
+    state->temperatures[i] = qnap_ec_sim_config.ambient_temperature +
+      qnap_ec_sim_config.heat_load * qnap_ec_sim_temp_heat_loads[i];
+}
+
+// Function called to advance the simulation state to the current simulated time
+// Note: the fan speeds and temperatures approach their targets exponentially with the configured
+//       time constants and a temperature's equilibrium is its heat load above the ambient
+//       temperature at the initial fan speeds and twice that with all the fans stopped
+static void qnap_ec_sim_advance_state(struct qnap_ec_sim_state* state)
+{
+  // Declare needed variables
+  uint8_t i;
+  int64_t real_time;
+  double elapsed;
+  double factor;
+  double target;
+  struct timespec now;
+
+  // Get the elapsed time in milliseconds either from the fixed time step or the real time
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  real_time = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+  if (qnap_ec_sim_config.time_step > 0)
+    elapsed = qnap_ec_sim_config.time_step;
+  else
+    elapsed = real_time > state->real_time ? (real_time - state->real_time) / 1000000.0 : 0;
+  state->real_time = real_time;
+  state->time += (int64_t)(elapsed * 1000000);
+
+  // Loop through the fans and move each fan's speed towards the speed for its fan PWM value
+  factor = qnap_ec_sim_config.fan_inertia > 0 ? exp(-elapsed / qnap_ec_sim_config.fan_inertia) : 0;
+  for (i = 0; i < qnap_ec_sim_number_of_fans; ++i)
+  {
+    target = state->pwms[qnap_ec_sim_fan_pwm_groups[i]] * qnap_ec_sim_fan_rpm_per_pwm[i];
+    state->speeds[i] = target + (state->speeds[i] - target) * factor;
+  }
+
+  // Loop through the temperature sensors and move each temperature towards its equilibrium
+  //   temperature for the current airflow
+  factor = qnap_ec_sim_config.thermal_inertia > 0 ?
+    exp(-elapsed / qnap_ec_sim_config.thermal_inertia) : 0;
+  for (i = 0; i < qnap_ec_sim_number_of_temps; ++i)
+  {
+    target = qnap_ec_sim_config.ambient_temperature + qnap_ec_sim_config.heat_load *
+      qnap_ec_sim_temp_heat_loads[i] * 2 / (1 + qnap_ec_sim_get_airflow(state));
+    state->temperatures[i] = target + (state->temperatures[i] - target) * factor;
+  }
+}
+
+// Function called to get the airflow relative to the airflow at the initial fan speeds
+static double qnap_ec_sim_get_airflow(struct qnap_ec_sim_state* state)
+{
+  // Declare needed variables
+  uint8_t i;
+  double speeds = 0;
+  double initial_speeds = 0;
+
+  // Loop through the fans and add up the current and initial fan speeds
+  for (i = 0; i < qnap_ec_sim_number_of_fans; ++i)
+  {
+    speeds += state->speeds[i];
+    initial_speeds += qnap_ec_sim_initial_pwms[qnap_ec_sim_fan_pwm_groups[i]] *
+      qnap_ec_sim_fan_rpm_per_pwm[i];
+  }
+
+  return initial_speeds > 0 ? speeds / initial_speeds : 1;
+}
+
+// Function called to get a pseudo random number between -1 and 1 using the xorshift64* generator
+static double qnap_ec_sim_get_random(struct qnap_ec_sim_state* state)
+{
+  // Advance the generator
+  state->random_state ^= state->random_state >> 12;
+  state->random_state ^= state->random_state << 25;
+  state->random_state ^= state->random_state >> 27;
+
+  return (double)((state->random_state * 0x2545F4914F6CDD1DULL) >> 11) / (double)(1ULL << 52) - 1;
+}
+
+// Function called to get the profile values of a channel
+// Note: channels beyond the profile get the values of an unknown channel
+static const struct qnap_ec_sim_profile_channel* qnap_ec_sim_get_profile_channel(uint8_t channel)
+{
+  // Define the values of an unknown channel
+  static const struct qnap_ec_sim_profile_channel unknown_channel = { -1, 0, -1, 0, -1, 0, -1, 0 };
+
+  // Make sure the profile is loaded and check if the channel is beyond the profile
+  qnap_ec_sim_init();
+  if (channel >= QNAP_EC_SIM_NUMBER_OF_CHANNELS)
+    return &unknown_channel;
+
+  return &qnap_ec_sim_profile[channel];
+}
+
+// Function called to get the fan PWM group of a channel or -1 if the channel has no fan PWM
+static int8_t qnap_ec_sim_get_pwm_group(uint8_t channel)
+{
+  if (channel >= QNAP_EC_SIM_NUMBER_OF_CHANNELS)
+    return -1;
+
+  return qnap_ec_sim_channel_pwm_groups[channel];
+}
+
+// Function called to get the modeled fan of a channel or -1 if the channel isn't a modeled fan
+static int8_t qnap_ec_sim_get_fan(uint8_t channel)
+{
+  if (channel >= QNAP_EC_SIM_NUMBER_OF_CHANNELS)
+    return -1;
+
+  return qnap_ec_sim_channel_fans[channel];
+}
+
+// Function called to get the modeled temperature sensor of a channel or -1 if the channel isn't a
+//   modeled temperature sensor
+static int8_t qnap_ec_sim_get_temp(uint8_t channel)
+{
+  if (channel >= QNAP_EC_SIM_NUMBER_OF_CHANNELS)
+    return -1;
+
+  return qnap_ec_sim_channel_temps[channel];
+}
@@ -0,0 +1,48 @@
+# QNAP TS-673A simulated libuLinux_hal library profile
+#
+# Values returned by the libuLinux_hal library running on a TS-673A unit under QTS (see the top of
+# the libuLinux_hal-simulated.c file) with one line per channel listing the channel followed by
+# the return value and the value of the ec_sys_get_fan_status, ec_sys_get_fan_speed,
+# ec_sys_get_fan_pwm, and ec_sys_get_temperature functions (channels that are not listed return -1
+# for every function)
+#
+# channel  status       speed        pwm          temperature
+0          0 0          0 666        0 80         0 29
+1          0 0          0 661        0 80         0 -1
+2          0 1          0 65535      0 80        -1 0
+3          0 1          0 65535      0 80        -1 0
+4          0 1          0 65535      0 80        -1 0
+5          0 1          0 65535      0 80         0 23
+6          0 0          0 891        0 90         0 25
+7          0 1          0 65535      0 90         0 30
+8         -1 0         -1 0         -1 0         -1 0
+9         -1 0         -1 0         -1 0         -1 0
+10         0 0          0 -2        -1 0          0 -2
+11         0 0          0 -2        -1 0          0 -2
+12        -1 0         -1 0         -1 0         -1 0
+13        -1 0         -1 0         -1 0         -1 0
+14        -1 0         -1 0         -1 0         -1 0
+15        -1 0         -1 0         -1 0          0 -128
+16        -1 0         -1 0         -1 0          0 -1
+17        -1 0         -1 0         -1 0          0 -1
+18        -1 0         -1 0         -1 0          0 -1
+19        -1 0         -1 0         -1 0          0 -1
+20         0 0          0 65535      0 100        0 -1
+21         0 0          0 65535      0 100        0 -1
+22         0 0          0 65535      0 100        0 -1
+23         0 0          0 65535      0 100        0 -1
+24         0 0          0 65535      0 100        0 -1
+25         0 0          0 65535      0 100        0 -1
+26        -1 0         -1 0         -1 0          0 -1
+27        -1 0         -1 0         -1 0          0 -1
+28        -1 0         -1 0         -1 0          0 -1
+29        -1 0         -1 0         -1 0          0 -1
+30         0 0          0 65535      0 650        0 -1
+31         0 0          0 65535      0 650        0 -1
+32         0 0          0 65535      0 650        0 -1
+33         0 0          0 4976       0 650        0 -1
+34         0 0          0 12096      0 650        0 -1
+35         0 0          0 65535      0 650        0 -1
+36        -1 0         -1 0         -1 0          0 -1
+37        -1 0         -1 0         -1 0          0 -1
+38        -1 0         -1 0         -1 0          0 -1
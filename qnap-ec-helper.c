@@ -16,31 +16,126 @@
  */
 
 #include <dlfcn.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
 #include "qnap-ec-ioctl.h"
+#include "qnap-ec-trace.h"
+
+// Declare functions
+static void* qnap_ec_open_library(void);
+static void qnap_ec_load_functions(void* library);
+static int qnap_ec_call_function(struct qnap_ec_ioctl_command* ioctl_command);
+static void qnap_ec_run_ring(int device, struct qnap_ec_ring* ring);
+static void qnap_ec_supervise_workers(long workers);
+static int qnap_ec_open_trace(const char* path);
+static void qnap_ec_write_trace(struct qnap_ec_ioctl_command* ioctl_command,
+                                struct timespec* start_real_time,
+                                struct timespec* start_monotonic_time);
+
+// Declare the libuLinux_hal library function pointers array indexed by the function identifiers
+//   and the trace file descriptor
+static void* qnap_ec_functions[number_of_funcs];
+static int qnap_ec_trace_file = -1;
 
 // Function called as main entry point
+// Note: when called with the -d or --daemon argument the helper program keeps the libuLinux_hal
+//       library loaded and processes commands from the kernel module until it is terminated instead
+//       of processing a single command and exiting and when called with the -t or --trace argument
+//       followed by a file path every libuLinux_hal library function call is appended to that
+//       trace file
+// Note: when called with the -s or --standby argument followed by a number in addition to the -d or
+//       --daemon argument the helper program forks one daemon worker process plus that many
+//       standby worker processes which each open the device and keep the library loaded so that a
+//       standby worker can take over right away if the worker processing the commands exits or is
+//       killed (for example by the kernel module because a library function call took too long)
+//       while the original process starts a new worker in place of every worker that exits
+// Note: the standby workers do not process commands in parallel with the active worker since the
+//       library function calls all access the embedded controller chip through the same ports and
+//       two calls running at the same time would corrupt each other's results
 int main(int argc, char** argv)
 {
-  // Declare needed variables
-  char* error;
+  // Declare and/or define needed variables
+  uint16_t i;
   int device;
   void* library;
-  struct qnap_ec_ioctl_command ioctl_command;
-  int8_t (*int8_function_uint8_uint32pointer)(uint8_t, uint32_t*);
-  int8_t (*int8_function_uint8_doublepointer)(uint8_t, double*);
-  int8_t (*int8_function_uint8_uint8)(uint8_t, uint8_t);
-  double double_value;
+  size_t ring_size;
+  struct qnap_ec_ring* ring;
+  struct qnap_ec_ioctl_hello hello;
+  struct qnap_ec_ioctl_batch_command ioctl_batch;
+  bool daemon = false;
+  char* trace_path = NULL;
+  char* end;
+  long standby = 0;
 
   // Open the system log
   openlog("qnap-ec", LOG_PID, LOG_USER);
 
+  // Loop through the arguments
+  for (i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--daemon") == 0)
+    {
+      daemon = true;
+    }
+    else if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--trace") == 0) && i + 1 < argc)
+    {
+      trace_path = argv[++i];
+    }
+    else if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--standby") == 0) && i + 1 < argc)
+    {
+      standby = strtol(argv[++i], &end, 10);
+      if (*argv[i] == '\0' || *end != '\0' || standby < 0 ||
+          standby > QNAP_EC_MAX_DAEMON_WORKERS - 1)
+      {
+        syslog(LOG_ERR, "invalid number of standby workers (%s), must be between 0 and %u",
+          argv[i], QNAP_EC_MAX_DAEMON_WORKERS - 1);
+        closelog();
+        exit(EXIT_FAILURE);
+      }
+    }
+    else
+    {
+      syslog(LOG_ERR, "unknown or incomplete argument (%s)", argv[i]);
+      closelog();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Check if standby workers were requested without running as a daemon
+  if (standby > 0 && !daemon)
+  {
+    syslog(LOG_ERR, "the standby argument is only valid when running as a daemon");
+    closelog();
+    exit(EXIT_FAILURE);
+  }
+
+  // Check if we need to trace the library function calls and open the trace file
+  // Note: the trace file is opened before forking the workers so that all the workers append to the
+  //       same trace file which is safe since every record is appended with a single write call
+  if (trace_path != NULL && qnap_ec_open_trace(trace_path) != 0)
+  {
+    closelog();
+    exit(EXIT_FAILURE);
+  }
+
+  // Check if standby workers were requested and fork the active and standby workers and keep
+  //   supervising them in this process
+  // Note: this only returns in the forked workers
+  if (standby > 0)
+    qnap_ec_supervise_workers(standby + 1);
+
   // Open the qnap-ec device
   device = open("/dev/qnap-ec", O_RDWR);
   if (device < 0)
@@ -50,14 +145,230 @@ int main(int argc, char** argv)
     exit(EXIT_FAILURE);
   }
 
-  // Make a I/O control call to the device to find out which function in the library needs to be
-  //   called
-  if (ioctl(device, QNAP_EC_IOCTL_CALL, &ioctl_command) != 0)
+  // Make the handshake I/O control call to the device to make sure the kernel module uses the same
+  //   I/O control interface version
+  hello.version = QNAP_EC_IOCTL_VERSION;
+  if (ioctl(device, QNAP_EC_IOCTL_HELLO, &hello) != 0)
+  {
+    syslog(LOG_ERR, "qnap-ec device does not use I/O control interface version %u (%s)",
+      QNAP_EC_IOCTL_VERSION, strerror(errno));
+    close(device);
+    closelog();
+    exit(EXIT_FAILURE);
+  }
+
+  // Check if we are not running as a daemon and make a I/O control call to the device to find out
+  //   which functions in the library need to be called
+  if (!daemon && ioctl(device, QNAP_EC_IOCTL_BATCH_CALL, &ioctl_batch) != 0)
+  {
+    close(device);
+    closelog();
+    exit(EXIT_FAILURE);
+  }
+
+  // Open the libuLinux_hal library and get pointers to all the functions
+  library = qnap_ec_open_library();
+  if (library == NULL)
   {
     close(device);
     closelog();
     exit(EXIT_FAILURE);
   }
+  qnap_ec_load_functions(library);
+
+  // Check if we are not running as a daemon
+  if (!daemon)
+  {
+    // Loop through the commands and call the library functions
+    for (i = 0; i < ioctl_batch.number_of_commands && i < QNAP_EC_IOCTL_BATCH_SIZE; ++i)
+    {
+      if (qnap_ec_call_function(&ioctl_batch.commands[i]) != 0)
+      {
+        dlclose(library);
+        close(device);
+        closelog();
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    // Make the I/O control call to the device to return the data
+    if (ioctl(device, QNAP_EC_IOCTL_BATCH_RETURN, &ioctl_batch) != 0)
+    {
+      dlclose(library);
+      close(device);
+      closelog();
+      exit(EXIT_FAILURE);
+    }
+
+    // Close the libuLinux_hal library
+    dlclose(library);
+
+    // Close the qnap-ec device
+    close(device);
+
+    // Close the system log
+    closelog();
+
+    exit(EXIT_SUCCESS);
+  }
+
+  // Map the shared memory command ring and process commands using the ring if successful
+  syslog(LOG_INFO, "running as a daemon");
+  ring_size = (sizeof(struct qnap_ec_ring) + sysconf(_SC_PAGESIZE) - 1) & ~(sysconf(_SC_PAGESIZE) -
+    1);
+  ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, device, 0);
+  if (ring != MAP_FAILED)
+  {
+    qnap_ec_run_ring(device, ring);
+    munmap(ring, ring_size);
+    dlclose(library);
+    close(device);
+    closelog();
+    exit(EXIT_FAILURE);
+  }
+  syslog(LOG_WARNING, "unable to map the qnap-ec device command ring (%s), falling back to I/O "
+    "control calls", strerror(errno));
+
+  // Loop forever processing commands
+  for (;;)
+  {
+    // Make the I/O control call to the device to wait for the next batch of commands
+    if (ioctl(device, QNAP_EC_IOCTL_BATCH_WAIT, &ioctl_batch) != 0)
+    {
+      // Check if we were interrupted by a signal and try again
+      if (errno == EINTR)
+        continue;
+
+      syslog(LOG_ERR, "unable to wait for commands from the qnap-ec device (%s)", strerror(errno));
+      dlclose(library);
+      close(device);
+      closelog();
+      exit(EXIT_FAILURE);
+    }
+
+    // Loop through the commands and call the library functions and report any failure to call a
+    //   function as a library function error so that the daemon keeps running
+    for (i = 0; i < ioctl_batch.number_of_commands && i < QNAP_EC_IOCTL_BATCH_SIZE; ++i)
+      if (qnap_ec_call_function(&ioctl_batch.commands[i]) != 0)
+        ioctl_batch.commands[i].return_value_int8 = -1;
+
+    // Make the I/O control call to the device to return the data
+    if (ioctl(device, QNAP_EC_IOCTL_BATCH_RETURN, &ioctl_batch) != 0)
+    {
+      syslog(LOG_ERR, "unable to return data to the qnap-ec device (%s)", strerror(errno));
+      dlclose(library);
+      close(device);
+      closelog();
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+// Function called to process commands using the shared memory command ring
+// Note: this function only returns if an error occurs and the only system call made per batch of
+//       commands is the I/O control call that marks the previous commands as completed and waits
+//       for the next commands
+static void qnap_ec_run_ring(int device, struct qnap_ec_ring* ring)
+{
+  // Declare needed variables
+  uint32_t head;
+  uint32_t tail;
+  struct qnap_ec_ioctl_command* command;
+
+  // Loop forever processing commands
+  for (;;)
+  {
+    // Make the I/O control call to the device to complete the previous commands and wait for the
+    //   next commands
+    if (ioctl(device, QNAP_EC_IOCTL_RING_ENTER) != 0)
+    {
+      // Check if we were interrupted by a signal and try again
+      if (errno == EINTR)
+        continue;
+
+      syslog(LOG_ERR, "unable to wait for commands from the qnap-ec device (%s)", strerror(errno));
+      return;
+    }
+
+    // Loop through the submitted commands and call the library functions and report any failure
+    //   to call a function as a library function error so that the daemon keeps running
+    head = __atomic_load_n(&ring->submission_head, __ATOMIC_RELAXED);
+    tail = __atomic_load_n(&ring->submission_tail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+      command = &ring->slots[head % QNAP_EC_RING_SIZE];
+      if (qnap_ec_call_function(command) != 0)
+        command->return_value_int8 = -1;
+
+      // Advance the submission head and the completion tail
+      ++head;
+      __atomic_store_n(&ring->submission_head, head, __ATOMIC_RELAXED);
+      __atomic_store_n(&ring->completion_tail, head, __ATOMIC_RELEASE);
+    }
+  }
+}
+
+// Function called to fork the active and standby daemon worker processes and fork a new worker in
+//   place of every worker that exits
+// Note: this function only returns in the forked workers while the calling process keeps
+//       supervising the workers until it's terminated which also terminates the workers
+static void qnap_ec_supervise_workers(long workers)
+{
+  // Declare and/or define needed variables
+  pid_t pid;
+  int status;
+  long running = 0;
+  pid_t supervisor = getpid();
+
+  // Loop until this process is terminated
+  syslog(LOG_INFO, "supervising %ld daemon workers", workers);
+  for (;;)
+  {
+    // Loop until all the workers are running and fork a new worker
+    while (running < workers)
+    {
+      pid = fork();
+      if (pid < 0)
+      {
+        syslog(LOG_ERR, "unable to fork daemon worker (%s)", strerror(errno));
+        break;
+      }
+
+      // Check if this is the new worker and make sure it's terminated when this process exits
+      if (pid == 0)
+      {
+        if (prctl(PR_SET_PDEATHSIG, SIGTERM) != 0 || getppid() != supervisor)
+          exit(EXIT_FAILURE);
+        return;
+      }
+      ++running;
+    }
+
+    // Wait for a worker to exit
+    // Note: we also wait one second after a worker exits (or forking failed) so that a worker that
+    //       keeps exiting right away is not replaced in a tight loop
+    pid = wait(&status);
+    if (pid < 0 && errno == EINTR)
+      continue;
+    if (pid > 0)
+    {
+      --running;
+      if (WIFSIGNALED(status))
+        syslog(LOG_WARNING, "daemon worker %d was killed by signal %d, starting a new worker", pid,
+          WTERMSIG(status));
+      else
+        syslog(LOG_WARNING, "daemon worker %d exited with exit code %d, starting a new worker",
+          pid, WEXITSTATUS(status));
+    }
+    sleep(1);
+  }
+}
+
+// Function called to open the libuLinux_hal library
+static void* qnap_ec_open_library(void)
+{
+  // Declare needed variables
+  void* library;
 
   // Open the libuLinux_hal library
 #ifdef PACKAGE
@@ -78,57 +389,80 @@ int main(int argc, char** argv)
       syslog(LOG_ERR, "libuLinux_hal library not found at the expected path (/usr/local/lib/"
         "libuLinux_hal.so) or any of the paths searched in by the dynamic linker");
 #endif
-      close(device);
-      closelog();
-      exit(EXIT_FAILURE);
+      return NULL;
     }
   }
 
-  // Switch based on the function type
-  switch (ioctl_command.function_type)
+  return library;
+}
+
+// Function called to get pointers to all the functions in the libuLinux_hal library
+// Note: the pointers are looked up once so that no symbol lookups are needed when calling the
+//       functions and any function that is not found is left as a NULL pointer
+static void qnap_ec_load_functions(void* library)
+{
+  // Declare needed variables
+  uint8_t i;
+  char* error;
+
+  // Loop through the functions
+  for (i = 0; i < number_of_funcs; ++i)
   {
-    case int8_func_uint8_uint32pointer:
-      // Clear any previous dynamic link errors
-      dlerror();
+    // Clear any previous dynamic link errors
+    dlerror();
 
-      // Get a pointer to the function
-      int8_function_uint8_uint32pointer = dlsym(library, ioctl_command.function_name);
-      error = dlerror();
-      if (error != NULL)
-      {
-        syslog(LOG_ERR, "encountered the following dynamic linker error: %s", error);
-        dlclose(library);
-        close(device);
-        closelog();
-        exit(EXIT_FAILURE);
-      }
+    // Get a pointer to the function
+    qnap_ec_functions[i] = dlsym(library, qnap_ec_ioctl_function_names[i]);
+    error = dlerror();
+    if (error != NULL)
+    {
+      syslog(LOG_ERR, "encountered the following dynamic linker error: %s", error);
+      qnap_ec_functions[i] = NULL;
+    }
+  }
+}
 
+// Function called to call the function in the libuLinux_hal library described by the I/O control
+//   command
+static int qnap_ec_call_function(struct qnap_ec_ioctl_command* ioctl_command)
+{
+  // Declare needed variables
+  int8_t (*int8_function_uint8_uint32pointer)(uint8_t, uint32_t*);
+  int8_t (*int8_function_uint8_doublepointer)(uint8_t, double*);
+  int8_t (*int8_function_uint8_uint8)(uint8_t, uint8_t);
+  double double_value;
+  struct timespec start_real_time;
+  struct timespec start_monotonic_time;
+
+  // Check if the function identifier is invalid or the function was not found
+  if (ioctl_command->function >= number_of_funcs || qnap_ec_functions[ioctl_command->function] ==
+      NULL)
+    return -1;
+
+  // Check if we are tracing the library function calls and get the start times
+  if (qnap_ec_trace_file >= 0)
+  {
+    clock_gettime(CLOCK_REALTIME, &start_real_time);
+    clock_gettime(CLOCK_MONOTONIC, &start_monotonic_time);
+  }
+
+  // Switch based on the function type
+  switch (qnap_ec_ioctl_function_types[ioctl_command->function])
+  {
+    case int8_func_uint8_uint32pointer:
       // Call the library function
-      ioctl_command.return_value_int8 = int8_function_uint8_uint32pointer(ioctl_command.
-        argument1_uint8, &ioctl_command.argument2_uint32);
+      int8_function_uint8_uint32pointer = qnap_ec_functions[ioctl_command->function];
+      ioctl_command->return_value_int8 = int8_function_uint8_uint32pointer(ioctl_command->
+        argument1_uint8, &ioctl_command->argument2_uint32);
 
       break;
     case int8_func_uint8_doublepointer:
-      // Clear any previous dynamic link errors
-      dlerror();
-
-      // Get a pointer to the function
-      int8_function_uint8_doublepointer = dlsym(library, ioctl_command.function_name);
-      error = dlerror();
-      if (error != NULL)
-      {
-        syslog(LOG_ERR, "encountered the following dynamic linker error: %s", error);
-        dlclose(library);
-        close(device);
-        closelog();
-        exit(EXIT_FAILURE);
-      }
-
       // Cast the int64 field to a double value (see note below)
-      double_value = (double)((long double)ioctl_command.argument2_int64 / (long double)1000);
+      double_value = (double)((long double)ioctl_command->argument2_int64 / (long double)1000);
 
       // Call the library function
-      ioctl_command.return_value_int8 = int8_function_uint8_doublepointer(ioctl_command.
+      int8_function_uint8_doublepointer = qnap_ec_functions[ioctl_command->function];
+      ioctl_command->return_value_int8 = int8_function_uint8_doublepointer(ioctl_command->
         argument1_uint8, &double_value);
 
       // Cast the double value back to the int64 field by multiplying it by 1000 and rounding it
@@ -138,57 +472,118 @@ int main(int argc, char** argv)
       //       we can multiple the double value by 1000 to move three digits after the decimal
       //       point to before the decimal point and still fit the value in an int64 value and
       //       preserve three digits after the decimal point
-      ioctl_command.argument2_int64 = (int64_t)((long double)double_value * (long double)1000 +
+      ioctl_command->argument2_int64 = (int64_t)((long double)double_value * (long double)1000 +
         (long double)0.5);
 
       break;
     case int8_func_uint8_uint8:
-      // Clear any previous dynamic link errors
-      dlerror();
-
-      // Get a pointer to the function
-      int8_function_uint8_uint8 = dlsym(library, ioctl_command.function_name);
-      error = dlerror();
-      if (error  != NULL)
-      {
-        syslog(LOG_ERR, "encountered the following dynamic linker error: %s", error);
-        dlclose(library);
-        close(device);
-        closelog();
-        exit(EXIT_FAILURE);
-      }
-
       // Call the library function
-      ioctl_command.return_value_int8 = int8_function_uint8_uint8(ioctl_command.argument1_uint8,
-        ioctl_command.argument2_uint8);
+      int8_function_uint8_uint8 = qnap_ec_functions[ioctl_command->function];
+      ioctl_command->return_value_int8 = int8_function_uint8_uint8(ioctl_command->argument1_uint8,
+        ioctl_command->argument2_uint8);
 
       break;
     default:
-      dlclose(library);
-      close(device);
-      closelog();
-      exit(EXIT_FAILURE);
+      return -1;
+  }
+
+  // Check if we are tracing the library function calls and write the trace record
+  if (qnap_ec_trace_file >= 0)
+    qnap_ec_write_trace(ioctl_command, &start_real_time, &start_monotonic_time);
+
+  return 0;
+}
+
+// Function called to open the trace file and write the trace header if the file is new or check
+//   the trace header if the file already exists
+// Note: the trace file is opened in append mode so that the records written by helper program
+//       processes running at the same time are not interleaved and the file is closed when the
+//       helper program exits
+// Note: an existing trace file whose header does not match the current trace format is not appended
+//       to since its records could not be told apart from the new records
+static int qnap_ec_open_trace(const char* path)
+{
+  // Declare needed variables
+  struct qnap_ec_trace_header header;
+
+  // Try to create a new trace file and write the trace header
+  qnap_ec_trace_file = open(path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (qnap_ec_trace_file >= 0)
+  {
+    header.magic = QNAP_EC_TRACE_MAGIC;
+    header.version = QNAP_EC_TRACE_VERSION;
+    if (write(qnap_ec_trace_file, &header, sizeof(header)) != sizeof(header))
+    {
+      syslog(LOG_ERR, "unable to write to trace file (%s)", path);
+      close(qnap_ec_trace_file);
+      qnap_ec_trace_file = -1;
+      return -1;
+    }
+
+    return 0;
   }
 
-  // Make the I/O control call to the device to return the data
-  if (ioctl(device, QNAP_EC_IOCTL_RETURN, &ioctl_command) != 0)
+  // Open the existing trace file
+  if (errno == EEXIST)
+    qnap_ec_trace_file = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+  if (qnap_ec_trace_file < 0)
   {
-    dlclose(library);
-    close(device);
-    closelog();
-    exit(EXIT_FAILURE);
+    syslog(LOG_ERR, "unable to open trace file (%s)", path);
+    return -1;
+  }
+
+  // Check the existing trace file's header
+  if (pread(qnap_ec_trace_file, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != QNAP_EC_TRACE_MAGIC || header.version != QNAP_EC_TRACE_VERSION)
+  {
+    syslog(LOG_ERR, "trace file (%s) is not a version %u trace file", path,
+      QNAP_EC_TRACE_VERSION);
+    close(qnap_ec_trace_file);
+    qnap_ec_trace_file = -1;
+    return -1;
   }
 
-  // Close the libuLinux_hal library
-  dlclose(library);
+  return 0;
+}
 
-  // Close the qnap-ec device
-  close(device);
+// Function called to write the trace record for a libuLinux_hal library function call
+static void qnap_ec_write_trace(struct qnap_ec_ioctl_command* ioctl_command,
+                                struct timespec* start_real_time,
+                                struct timespec* start_monotonic_time)
+{
+  // Declare needed variables
+  struct timespec end_monotonic_time;
+  struct qnap_ec_trace_record record;
+
+  // Get the end time
+  clock_gettime(CLOCK_MONOTONIC, &end_monotonic_time);
 
-  // Close the system log
-  closelog();
+  // Fill in the trace record
+  memset(&record, 0, sizeof(record));
+  record.start_time = (uint64_t)start_real_time->tv_sec * 1000000000 + start_real_time->tv_nsec;
+  record.duration = (uint64_t)(end_monotonic_time.tv_sec - start_monotonic_time->tv_sec) *
+    1000000000 + end_monotonic_time.tv_nsec - start_monotonic_time->tv_nsec;
+  record.function = ioctl_command->function;
+  record.channel = ioctl_command->argument1_uint8;
+  record.return_value = ioctl_command->return_value_int8;
+  switch (qnap_ec_ioctl_function_types[ioctl_command->function])
+  {
+    case int8_func_uint8_uint32pointer:
+      record.value = ioctl_command->argument2_uint32;
+      break;
+    case int8_func_uint8_doublepointer:
+      record.value = ioctl_command->argument2_int64;
+      break;
+    case int8_func_uint8_uint8:
+      record.value = ioctl_command->argument2_uint8;
+      break;
+  }
 
-  exit(EXIT_SUCCESS);
+  // Write the trace record
+  // Note: a failure to write a trace record is logged but otherwise ignored so that tracing never
+  //       affects the values returned to the kernel module
+  if (write(qnap_ec_trace_file, &record, sizeof(record)) != sizeof(record))
+    syslog(LOG_WARNING, "unable to write to trace file");
 }
 
 // Function called by functions in the libuLinux_hal library that is normally located in the
@@ -472,20 +472,124 @@ enum qnap_ec_ioctl_function_type {
   int8_func_uint8_uint8
 };
 
+// Define the I/O control interface version
+// Note: the version has to be increased whenever any of the structures, functions, or commands in
+//       this file change since the kernel module refuses to talk to a helper program with a
+//       different version
+#define QNAP_EC_IOCTL_VERSION 3
+
+// Define the libuLinux_hal library function identifiers
+// Note: new functions have to be added before the number_of_funcs entry and to the function names
+//       and function types arrays below
+enum qnap_ec_ioctl_function {
+  func_ec_sys_get_fan_status,
+  func_ec_sys_get_fan_speed,
+  func_ec_sys_get_fan_pwm,
+  func_ec_sys_get_temperature,
+  func_ec_sys_set_fan_speed,
+  number_of_funcs
+};
+
+// Define the libuLinux_hal library function names and types indexed by the function identifiers
+static const char* const qnap_ec_ioctl_function_names[number_of_funcs] = {
+  [func_ec_sys_get_fan_status] = "ec_sys_get_fan_status",
+  [func_ec_sys_get_fan_speed] = "ec_sys_get_fan_speed",
+  [func_ec_sys_get_fan_pwm] = "ec_sys_get_fan_pwm",
+  [func_ec_sys_get_temperature] = "ec_sys_get_temperature",
+  [func_ec_sys_set_fan_speed] = "ec_sys_set_fan_speed"
+};
+static const enum qnap_ec_ioctl_function_type qnap_ec_ioctl_function_types[number_of_funcs] = {
+  [func_ec_sys_get_fan_status] = int8_func_uint8_uint32pointer,
+  [func_ec_sys_get_fan_speed] = int8_func_uint8_uint32pointer,
+  [func_ec_sys_get_fan_pwm] = int8_func_uint8_uint32pointer,
+  [func_ec_sys_get_temperature] = int8_func_uint8_doublepointer,
+  [func_ec_sys_set_fan_speed] = int8_func_uint8_uint8
+};
+
 // Define the I/O control command structure
 // Note: we are using an int64 field instead of a double field because floating point math is not
 //       possible in kernel space
+// Note: the function field holds one of the libuLinux_hal library function identifiers and the
+//       fields are ordered to keep the structure compact (16 bytes)
 struct qnap_ec_ioctl_command {
-  enum qnap_ec_ioctl_function_type function_type;
-  char function_name[50];
+  uint8_t function;
   uint8_t argument1_uint8;
   uint8_t argument2_uint8;
+  int8_t return_value_int8;
   uint32_t argument2_uint32;
   int64_t argument2_int64;
-  int8_t return_value_int8;
+};
+
+// Define the handshake I/O control command structure
+// Note: the helper program sets the version field to the version it was built with before making
+//       the call and the kernel module sets the version field to its own version and the number of
+//       functions field to the number of library functions it knows about before returning
+struct qnap_ec_ioctl_hello {
+  uint32_t version;
+  uint32_t number_of_functions;
+};
+
+// Define the maximum number of commands in a batch I/O control command
+// Note: this allows all the fan (64), PWM (64), and temperature (64) channels to be read in one
+//       batch
+#define QNAP_EC_IOCTL_BATCH_SIZE 192
+
+// Define the batch I/O control command structure
+// Note: only the first number_of_commands commands are copied to and from user space and the
+//       number of commands is never changed by the helper program
+struct qnap_ec_ioctl_batch_command {
+  uint16_t number_of_commands;
+  struct qnap_ec_ioctl_command commands[QNAP_EC_IOCTL_BATCH_SIZE];
+};
+
+// Define the number of command slots in the shared memory command ring
+// Note: this has to be a power of two that is greater than or equal to the maximum number of
+//       commands in a batch
+#define QNAP_EC_RING_SIZE 256
+
+// Define the shared memory command ring structure that is mapped into the helper program daemon's
+//   address space by calling mmap on the device
+// Note: the kernel module writes commands into the slots starting at the submission tail and then
+//       advances the submission tail while the daemon processes the commands in place starting at
+//       the submission head and then advances the submission head and completion tail, all indexes
+//       are free running and are converted to slot numbers by using them modulo the ring size
+struct qnap_ec_ring {
+  uint32_t submission_head;
+  uint32_t submission_tail;
+  uint32_t completion_tail;
+  uint32_t reserved;
+  struct qnap_ec_ioctl_command slots[QNAP_EC_RING_SIZE];
 };
 
 // Define I/O control commands
 // Note: using I/O control number 10 to match the major number of the miscellaneous device
-#define QNAP_EC_IOCTL_CALL _IOR(10, 0, struct qnap_ec_ioctl_command)
-#define QNAP_EC_IOCTL_RETURN _IOW(10, 1, struct qnap_ec_ioctl_command)
\ No newline at end of file
+// Note: the handshake command has to be made once after opening the device and before making any
+//       other command
+// Note: the I/O control numbers 0, 1, and 2 were used by the single command versions of the call,
+//       return, and wait commands which have been removed since every helper program that makes
+//       the handshake command uses the batch versions
+#define QNAP_EC_IOCTL_HELLO _IOWR(10, 7, struct qnap_ec_ioctl_hello)
+#define QNAP_EC_IOCTL_BATCH_CALL _IOR(10, 3, struct qnap_ec_ioctl_batch_command)
+#define QNAP_EC_IOCTL_BATCH_RETURN _IOW(10, 4, struct qnap_ec_ioctl_batch_command)
+
+// Define the maximum number of helper program daemon workers that can be attached at the same time
+// Note: every worker opens the device separately and the kernel module passes each batch to only
+//       one of the workers while the others are kept ready to take over
+#define QNAP_EC_MAX_DAEMON_WORKERS 8
+
+// Define the I/O control commands used by the helper program when running as a daemon
+// Note: these commands block until the kernel module has a command for the daemon to process and
+//       the result is returned with the QNAP_EC_IOCTL_BATCH_RETURN command
+#define QNAP_EC_IOCTL_BATCH_WAIT _IOR(10, 5, struct qnap_ec_ioctl_batch_command)
+
+// Define the I/O control command used by the helper program daemon when using the shared memory
+//   command ring
+// Note: this command marks all the previously submitted commands in the ring as completed and then
+//       blocks until the kernel module has submitted new commands to the ring
+#define QNAP_EC_IOCTL_RING_ENTER _IO(10, 6)
+
+// Define the I/O control command used by other user space clients (for example diagnostic tools)
+//   to call a batch of functions with the same backends the kernel module uses
+// Note: only the functions that get a fan status, fan speed, fan PWM, or temperature are allowed
+//       and the results are copied back into the batch once all the functions have been called
+#define QNAP_EC_IOCTL_QUERY _IOWR(10, 8, struct qnap_ec_ioctl_batch_command)
\ No newline at end of file
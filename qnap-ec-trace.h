@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2021 Stonyx
+ * https://www.stonyx.com/
+ *
+ * This driver is free software. You can redistribute it and/or modify it under the terms of the
+ * GNU General Public License Version 3 (or at your option any later version) as published by The
+ * Free Software Foundation.
+ *
+ * This driver is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * If you did not received a copy of the GNU General Public License along with this script see
+ * http://www.gnu.org/copyleft/gpl.html or write to The Free Software Foundation, 675 Mass Ave,
+ * Cambridge, MA 02139, USA.
+ */
+
+// A trace file consists of a header followed by one record per libuLinux_hal library function call
+//   in the order the calls were made and all values are stored in the byte order of the machine the
+//   trace was recorded on
+// Note: the function values are the qnap_ec_ioctl_function values, the value is the fan status,
+//       fan speed, or fan PWM value returned by the call, the temperature returned by the call
+//       multiplied by 1000, or the fan PWM value passed to the call depending on the function,
+//       the start time is the real time in nanoseconds so that records appended by several helper
+//       program processes can be ordered, and the duration is in nanoseconds
+
+#define QNAP_EC_TRACE_MAGIC 0x54434551
+#define QNAP_EC_TRACE_VERSION 2
+
+struct qnap_ec_trace_header {
+  uint32_t magic;
+  uint32_t version;
+};
+
+struct qnap_ec_trace_record {
+  uint64_t start_time;
+  uint64_t duration;
+  uint8_t function;
+  uint8_t channel;
+  int8_t return_value;
+  uint8_t reserved[5];
+  int64_t value;
+};
@@ -15,13 +15,32 @@
  * Cambridge, MA 02139, USA.
  */
 
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/completion.h>
+#include <linux/delay.h>
+#include <linux/dmi.h>
 #include <linux/fs.h>
 #include <linux/hwmon.h>
 #include <linux/io.h>
+#include <linux/jiffies.h>
+#include <linux/kref.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/pid.h>
 #include <linux/platform_device.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+#include <linux/seqlock.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/umh.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/wait_bit.h>
+#include <linux/workqueue.h>
 #include "qnap-ec-ioctl.h"
 
 // Define the pr_err prefix
@@ -36,6 +55,20 @@ MODULE_LICENSE("GPL");
 MODULE_PARM_DESC(val_pwm_channels, "Validate PWM channels");
 MODULE_PARM_DESC(sim_pwm_enable, "Simulate pwmX_enable sysfs attributes");
 MODULE_PARM_DESC(check_for_chip, "Check for QNAP IT8528 E.C. chip");
+MODULE_PARM_DESC(backend, "Backend used to access the E.C. chip (helper, daemon, spawn, it8528, or "
+  "sim)");
+MODULE_PARM_DESC(fan_cache_ttl, "Time in milliseconds fan speeds are cached for (0 to disable)");
+MODULE_PARM_DESC(pwm_cache_ttl, "Time in milliseconds fan PWM values are cached for (0 to disable)");
+MODULE_PARM_DESC(temp_cache_ttl, "Time in milliseconds temperatures are cached for (0 to disable)");
+MODULE_PARM_DESC(max_stale, "Time in milliseconds past the cache TTL that cached values are returned "
+  "while being refreshed in the background (0 to disable)");
+MODULE_PARM_DESC(poll_interval, "Time in milliseconds between background sensor polls (0 to disable)");
+MODULE_PARM_DESC(channel_map, "Trusted valid channel map as exported in the channel_map sysfs "
+  "attribute (fan=0x...,pwm=0x...,temp=0x...) used instead of checking the channels");
+MODULE_PARM_DESC(it8528_unsafe_writes, "Allow the it8528 backend to set fan PWMs by writing to "
+  "unconfirmed E.C. chip registers");
+MODULE_PARM_DESC(call_timeout, "Time in milliseconds the helper program is given to call a batch "
+  "of library functions before it is killed (0 to disable)");
 
 // Define maximum number of possible channels
 // Note: number of channels has to be multiples of 8 and less than 256 and is based on the switch
@@ -47,57 +80,254 @@ MODULE_PARM_DESC(check_for_chip, "Check for QNAP IT8528 E.C. chip");
 #define QNAP_EC_NUMBER_OF_PWM_CHANNELS QNAP_EC_NUMBER_OF_FAN_CHANNELS
 #define QNAP_EC_NUMBER_OF_TEMP_CHANNELS 64
 
+// Define the IT8528 embedded controller ports, status register bits, and command
+#define QNAP_EC_IT8528_DATA_PORT 0x68
+#define QNAP_EC_IT8528_COMMAND_PORT 0x6C
+#define QNAP_EC_IT8528_OUTPUT_BUFFER_FULL 0x01
+#define QNAP_EC_IT8528_INPUT_BUFFER_FULL 0x02
+#define QNAP_EC_IT8528_ACCESS_COMMAND 0x88
+
+// Define the helper program daemon command states
+enum qnap_ec_daemon_command_state {
+  qnap_ec_daemon_command_idle,
+  qnap_ec_daemon_command_pending,
+  qnap_ec_daemon_command_running,
+  qnap_ec_daemon_command_done,
+  qnap_ec_daemon_command_failed
+};
+
+// Define the cached sensor value structure
+// Note: the generation member is incremented every time a call to the libuLinux_hal library
+//       function for the channel completes (successfully or not) and the return_value member holds
+//       the result of that call so that threads that were waiting for the call can share it
+struct qnap_ec_cached_value {
+  long value;
+  unsigned long jiffies;
+  bool valid;
+  unsigned long generation;
+  int return_value;
+};
+
+// Define the sensor snapshot structure
+struct qnap_ec_snapshot {
+  long fan_values[QNAP_EC_NUMBER_OF_FAN_CHANNELS];
+  long pwm_values[QNAP_EC_NUMBER_OF_PWM_CHANNELS];
+  long temp_values[QNAP_EC_NUMBER_OF_TEMP_CHANNELS];
+  uint8_t fan_valid_field[QNAP_EC_NUMBER_OF_FAN_CHANNELS / 8];
+  uint8_t pwm_valid_field[QNAP_EC_NUMBER_OF_PWM_CHANNELS / 8];
+  uint8_t temp_valid_field[QNAP_EC_NUMBER_OF_TEMP_CHANNELS / 8];
+};
+
 // Define the devices structure
-// Note: in order to use the container_of macro in the qnap_ec_misc_dev_open and 
-//       qnap_ec_misc_dev_ioctl functions we need to make the misc_device member not a pointer
+// Note: in order to use the container_of macro in the qnap_ec_misc_dev_open function we need to
+//       make the misc_device member not a pointer
 //       and in order to use the platform_device_alloc function (see note in the qnap_ec_init
 //       function) we need to make the plat_device member a pointer
+// Note: the daemon_workers, spawn_pid, and spawn_timed_out members and the daemon_worker and
+//       daemon_command_state members of the file contexts are protected by the daemon_lock spin
+//       lock
+// Note: the daemon_workers member holds the contexts of the files attached as helper program daemon
+//       workers and the spawn_pid member is the process ID of the helper program the kernel module
+//       is currently spawning (if any) which is used to tell its file apart from the files of other
+//       openers and to kill it if the spawn_timeout_work member runs because it took too long
 struct qnap_ec_devices {
-  struct mutex misc_device_mutex;
-  bool open_misc_device;
   struct miscdevice misc_device;
   struct platform_device* plat_device;
+  spinlock_t daemon_lock;
+  struct qnap_ec_file_context* daemon_workers[QNAP_EC_MAX_DAEMON_WORKERS];
+  struct pid* spawn_pid;
+  struct delayed_work spawn_timeout_work;
+  bool spawn_timed_out;
+};
+
+// Define the miscellaneous device file context structure
+// Note: every opener of the miscellaneous device gets its own context (stored in the file's
+//       private_data member) so that the helper program daemon, a spawned helper program, and any
+//       number of other user space clients can have the device open at the same time
+// Note: the spawned member is set if the file was opened by the helper program the kernel module
+//       was spawning at the time, the handshake_done member is set once the handshake I/O control
+//       call was made, the ring member is the shared memory command ring mapped by the file, the
+//       ring_tail member is the kernel's copy of the ring's submission tail, and the batch member
+//       holds the commands of the file's query I/O control calls (which are protected by the mutex)
+//       or if the file is attached as a helper program daemon worker the commands passed to the
+//       worker
+// Note: the ring member is only allocated while holding the mutex and is published with release
+//       semantics after the ring_tail member has been reset so that it can be read without getting
+//       the mutex lock
+// Note: the reference count keeps the context around while the dispatcher is using it even if the
+//       file is released in the meantime and the pid member is the process ID of the opener which
+//       is used to kill a helper program daemon worker that took too long to return its commands
+struct qnap_ec_file_context {
+  struct qnap_ec_devices* devices;
+  struct kref refcount;
+  struct pid* pid;
+  bool spawned;
+  bool handshake_done;
+  struct qnap_ec_ring* ring;
+  uint32_t ring_tail;
+  struct mutex mutex;
+  bool daemon_worker;
+  enum qnap_ec_daemon_command_state daemon_command_state;
+  wait_queue_head_t daemon_wait_queue;
+  struct completion daemon_completion;
+  struct qnap_ec_ioctl_batch_command batch;
 };
 
 // Define the I/O control data structure
+// Note: the transport mutex protects the I/O control batch and the backends and is only held while
+//       one batch of calls is being queued, called, and its results saved so that independent reads
+//       only wait for each other at the transport while the write mutex is held for the whole of
+//       any operation that changes fan PWMs (setting a fan PWM value or the PWM enable value and
+//       the PWM channel sweep) and has to be locked before the transport mutex if both are needed
+// Note: the libuLinux_hal library functions that get a fan status, fan speed, fan PWM, or
+//       temperature only read from the E.C. chip so batches of them can be called in any order
+//       between the batches of other operations while the ec_sys_set_fan_speed function changes
+//       the fan PWM of every channel in the channel's fan group so it must not be called while the
+//       PWM channel sweep has changed a fan PWM (which the write mutex prevents) and a fan PWM read
+//       between the batches of the sweep can return a changed fan PWM (which is why the cached fan
+//       PWM values are invalidated after the sweep) and the transport mutex makes sure only one
+//       batch is in flight at a time and that no two library function calls overlap in the E.C.
+//       chip itself since every call is a multi step exchange on the same E.C. chip ports
+// Note: the cached values and the snapshot are protected by the values sequence lock so that they
+//       can be read without getting the transport mutex lock and are only written while holding
+//       both the transport mutex lock and the values sequence lock which makes the thread
+//       refreshing the values the only writer
+// Note: the channel checked and valid bitmaps are only ever changed with atomic bit operations (the
+//       valid bit before the checked bit) so that they can be read without getting any lock and
+//       the channel checking bitmaps hold the bits that make sure only one thread at a time checks
+//       a channel
+// Note: the ioctl_batch_channels member holds the channel of every command in the I/O control
+//       batch as it was queued which is used to index the per channel arrays instead of the
+//       channel in the returned commands since those are copied back from user space
 struct qnap_ec_data {
-  struct mutex mutex;
+  struct mutex write_mutex;
+  struct mutex transport_mutex;
+  seqlock_t values_lock;
   struct qnap_ec_devices* devices;
-  struct qnap_ec_ioctl_command ioctl_command;
-  uint8_t fan_channel_checked_field[QNAP_EC_NUMBER_OF_FAN_CHANNELS / 8];
-  uint8_t fan_channel_valid_field[QNAP_EC_NUMBER_OF_FAN_CHANNELS / 8];
-  uint8_t pwm_channel_checked_field[QNAP_EC_NUMBER_OF_PWM_CHANNELS / 8];
-  uint8_t pwm_channel_valid_field[QNAP_EC_NUMBER_OF_PWM_CHANNELS / 8];
+  struct qnap_ec_ioctl_batch_command ioctl_batch;
+  uint8_t ioctl_batch_channels[QNAP_EC_IOCTL_BATCH_SIZE];
+  DECLARE_BITMAP(fan_channel_checking_field, QNAP_EC_NUMBER_OF_FAN_CHANNELS);
+  DECLARE_BITMAP(fan_channel_checked_field, QNAP_EC_NUMBER_OF_FAN_CHANNELS);
+  DECLARE_BITMAP(fan_channel_valid_field, QNAP_EC_NUMBER_OF_FAN_CHANNELS);
+  DECLARE_BITMAP(pwm_channel_checking_field, QNAP_EC_NUMBER_OF_PWM_CHANNELS);
+  DECLARE_BITMAP(pwm_channel_checked_field, QNAP_EC_NUMBER_OF_PWM_CHANNELS);
+  DECLARE_BITMAP(pwm_channel_valid_field, QNAP_EC_NUMBER_OF_PWM_CHANNELS);
   uint8_t pwm_enable_value_field[QNAP_EC_NUMBER_OF_PWM_CHANNELS / 8];
-  uint8_t temp_channel_checked_field[QNAP_EC_NUMBER_OF_TEMP_CHANNELS / 8];
-  uint8_t temp_channel_valid_field[QNAP_EC_NUMBER_OF_TEMP_CHANNELS / 8];
+  DECLARE_BITMAP(temp_channel_checking_field, QNAP_EC_NUMBER_OF_TEMP_CHANNELS);
+  DECLARE_BITMAP(temp_channel_checked_field, QNAP_EC_NUMBER_OF_TEMP_CHANNELS);
+  DECLARE_BITMAP(temp_channel_valid_field, QNAP_EC_NUMBER_OF_TEMP_CHANNELS);
+  struct qnap_ec_cached_value fan_cached_values[QNAP_EC_NUMBER_OF_FAN_CHANNELS];
+  struct qnap_ec_cached_value pwm_cached_values[QNAP_EC_NUMBER_OF_PWM_CHANNELS];
+  struct qnap_ec_cached_value temp_cached_values[QNAP_EC_NUMBER_OF_TEMP_CHANNELS];
+  struct workqueue_struct* work_queue;
+  struct work_struct refresh_work;
+  unsigned long stale_types;
+  atomic_long_t stale_reads;
+  atomic_long_t timed_out_calls;
+  struct delayed_work poll_work;
+  struct qnap_ec_snapshot snapshot;
+  struct work_struct discovery_work;
+  struct device* hwmon_device;
+};
+
+// Define the backend structure
+// Note: the call_functions member is called with the transport mutex locked to call all the
+//       functions in the batch and if it returns -ENODEV, -ENOENT, -EBUSY, -EOPNOTSUPP, or -EIO
+//       because its transport is unavailable the batch is passed to the fallback backend (if there
+//       is one) while any other error code, including -ETIMEDOUT, is returned to the caller
+struct qnap_ec_backend {
+  const char* name;
+  int (*call_functions)(struct qnap_ec_data* data);
+  const struct qnap_ec_backend* fallback;
+};
+
+// Define the known model structure
+// Note: the channel maps hold one bit per valid channel in the same format as the channel_map
+//       module parameter
+struct qnap_ec_model {
+  unsigned long long fan_channel_map;
+  unsigned long long pwm_channel_map;
+  unsigned long long temp_channel_map;
 };
 
 // Declare functions
 static int __init qnap_ec_init(void);
 static int __init qnap_ec_is_chip_present(void);
 static int qnap_ec_probe(struct platform_device* platform_dev);
+static void qnap_ec_discover_channels(struct work_struct* work);
+static void qnap_ec_remove(void* data);
 static umode_t qnap_ec_hwmon_is_visible(const void* const_data, enum hwmon_sensor_types type,
                                         u32 attribute, int channel);
 static int qnap_ec_hwmon_read(struct device* dev, enum hwmon_sensor_types type, u32 attribute,
                               int channel, long* value);
 static int qnap_ec_hwmon_write(struct device* dev, enum hwmon_sensor_types type, u32 attribute,
                                int channel, long value);
+static ssize_t qnap_ec_show_stale_reads(struct device* device, struct device_attribute* attribute,
+                                        char* buffer);
+static ssize_t qnap_ec_show_timed_out_calls(struct device* device,
+                                            struct device_attribute* attribute, char* buffer);
+static ssize_t qnap_ec_show_channel_map(struct device* device, struct device_attribute* attribute,
+                                        char* buffer);
+static int qnap_ec_read_cached_value(struct qnap_ec_data* data, enum hwmon_sensor_types type,
+                                     uint8_t channel, long* value);
+static int qnap_ec_refresh_cached_values(struct qnap_ec_data* data, enum hwmon_sensor_types type,
+                                         int channel);
+static void qnap_ec_refresh_stale_values(struct work_struct* work);
+static void qnap_ec_invalidate_cached_pwm_values(struct qnap_ec_data* data);
+static bool qnap_ec_read_snapshot_value(struct qnap_ec_data* data, enum hwmon_sensor_types type,
+                                        uint8_t channel, long* value);
+static void qnap_ec_poll_sensors(struct work_struct* work);
 static bool qnap_ec_is_fan_channel_valid(struct qnap_ec_data* data, uint8_t channel);
 static bool qnap_ec_is_pwm_channel_valid(struct qnap_ec_data* data, uint8_t channel);
 static bool qnap_ec_is_temp_channel_valid(struct qnap_ec_data* data, uint8_t channel);
-static int qnap_ec_is_pwm_channel_valid_read_fan_pwms(struct qnap_ec_data* data, uint8_t channel,
-                                                      uint8_t initial_pwm_values[],
-                                                      uint8_t changed_pwm_values[]);
+static void qnap_ec_check_pwm_channels(struct qnap_ec_data* data);
+static bool qnap_ec_is_channel_checked(const unsigned long* checked_field,
+                                       const unsigned long* valid_field, uint8_t channel,
+                                       bool* valid);
+static void qnap_ec_mark_channel_checked(unsigned long* checked_field, unsigned long* valid_field,
+                                         uint8_t channel, bool valid);
+static bool qnap_ec_claim_channel_check(unsigned long* checking_field,
+                                        const unsigned long* checked_field,
+                                        const unsigned long* valid_field, uint8_t channel,
+                                        bool* valid);
 static int qnap_ec_call_lib_function(bool use_mutex, struct qnap_ec_data* data,
-                                     enum qnap_ec_ioctl_function_type function_type,
-                                     char* function_name, uint8_t argument1_uint8,
+                                     enum qnap_ec_ioctl_function function, uint8_t argument1_uint8,
                                      uint8_t* argument2_uint8, uint32_t* argument2_uint32,
                                      int64_t* argument2_int64, bool log_return_error);
+static int qnap_ec_queue_lib_function(struct qnap_ec_data* data,
+                                      enum qnap_ec_ioctl_function function,
+                                      uint8_t argument1_uint8, uint8_t argument2_uint8,
+                                      uint32_t argument2_uint32, int64_t argument2_int64);
+static int qnap_ec_call_lib_functions(struct qnap_ec_data* data);
+static int qnap_ec_call_helper_daemon(struct qnap_ec_data* data);
+static int qnap_ec_spawn_helper_program(struct qnap_ec_data* data);
+static int qnap_ec_spawn_helper_program_init(struct subprocess_info* info, struct cred* new);
+static void qnap_ec_spawn_helper_program_timeout(struct work_struct* work);
+static int qnap_ec_it8528_call_functions(struct qnap_ec_data* data);
+static int qnap_ec_it8528_call_function(struct qnap_ec_ioctl_command* command);
+static int qnap_ec_it8528_read_register(uint16_t address, uint8_t* value);
+static int qnap_ec_it8528_write_register(uint16_t address, uint8_t value);
+static int qnap_ec_it8528_wait_for_status(uint8_t bit, bool set);
+static int qnap_ec_sim_call_functions(struct qnap_ec_data* data);
+static void qnap_ec_sim_call_function(struct qnap_ec_ioctl_command* command);
 static int qnap_ec_misc_device_open(struct inode* inode, struct file* file);
 static long int qnap_ec_misc_device_ioctl(struct file* file, unsigned int command,
                                           unsigned long argument);
+static int qnap_ec_misc_device_copy_batch(struct qnap_ec_ioctl_batch_command* ioctl_batch,
+                                          unsigned long argument, bool to_user);
+static int qnap_ec_misc_device_return_command(struct qnap_ec_ioctl_command* command,
+                                              const struct qnap_ec_ioctl_command* returned_command);
+static int qnap_ec_misc_device_query(struct qnap_ec_file_context* context,
+                                     struct qnap_ec_data* data, unsigned long argument);
+static int qnap_ec_misc_device_ring_enter(struct qnap_ec_file_context* context);
+static int qnap_ec_misc_device_attach_daemon(struct qnap_ec_file_context* context);
+static bool qnap_ec_misc_device_detach_daemon(struct qnap_ec_file_context* context);
+static int qnap_ec_misc_device_wait_for_daemon_command(struct qnap_ec_file_context* context);
+static void qnap_ec_misc_device_complete_daemon_command(struct qnap_ec_file_context* context,
+  enum qnap_ec_daemon_command_state state);
+static int qnap_ec_misc_device_mmap(struct file* file, struct vm_area_struct* vma);
 static int qnap_ec_misc_device_release(struct inode* inode, struct file* file);
+static void qnap_ec_misc_device_free_context(struct kref* refcount);
 static void __exit qnap_ec_exit(void);
 
 // Specifiy the initialization and exit functions
@@ -108,9 +338,77 @@ module_exit(qnap_ec_exit);
 static bool qnap_ec_val_pwm_channels = true;
 static bool qnap_ec_sim_pwm_enable = false;
 static bool qnap_ec_check_for_chip = true;
+static char* qnap_ec_backend = "helper";
+static unsigned int qnap_ec_fan_cache_ttl = 1000;
+static unsigned int qnap_ec_pwm_cache_ttl = 1000;
+static unsigned int qnap_ec_temp_cache_ttl = 1000;
+static unsigned int qnap_ec_max_stale = 0;
+static unsigned int qnap_ec_poll_interval = 0;
+static char* qnap_ec_channel_map = NULL;
+static unsigned int qnap_ec_call_timeout = 5000;
+static bool qnap_ec_it8528_unsafe_writes = false;
 module_param_named(val_pwm_channels, qnap_ec_val_pwm_channels, bool, 0);
 module_param_named(sim_pwm_enable, qnap_ec_sim_pwm_enable, bool, 0);
 module_param_named(check_for_chip, qnap_ec_check_for_chip, bool, 0);
+module_param_named(backend, qnap_ec_backend, charp, 0);
+module_param_named(fan_cache_ttl, qnap_ec_fan_cache_ttl, uint, 0644);
+module_param_named(pwm_cache_ttl, qnap_ec_pwm_cache_ttl, uint, 0644);
+module_param_named(temp_cache_ttl, qnap_ec_temp_cache_ttl, uint, 0644);
+module_param_named(max_stale, qnap_ec_max_stale, uint, 0644);
+module_param_named(poll_interval, qnap_ec_poll_interval, uint, 0);
+module_param_named(channel_map, qnap_ec_channel_map, charp, 0);
+module_param_named(call_timeout, qnap_ec_call_timeout, uint, 0644);
+module_param_named(it8528_unsafe_writes, qnap_ec_it8528_unsafe_writes, bool, 0);
+
+// Define the backends
+// Note: the helper backend passes the batch to the helper program daemon if it's running and falls
+//       back to spawning the helper program while the daemon and spawn backends only use one of
+//       those transports which is useful for comparing them
+static const struct qnap_ec_backend qnap_ec_spawn_backend = {
+  .name = "spawn",
+  .call_functions = &qnap_ec_spawn_helper_program
+};
+static const struct qnap_ec_backend qnap_ec_daemon_backend = {
+  .name = "daemon",
+  .call_functions = &qnap_ec_call_helper_daemon
+};
+static const struct qnap_ec_backend qnap_ec_helper_backend = {
+  .name = "helper",
+  .call_functions = &qnap_ec_call_helper_daemon,
+  .fallback = &qnap_ec_spawn_backend
+};
+static const struct qnap_ec_backend qnap_ec_it8528_backend = {
+  .name = "it8528",
+  .call_functions = &qnap_ec_it8528_call_functions,
+  .fallback = &qnap_ec_helper_backend
+};
+static const struct qnap_ec_backend qnap_ec_sim_backend = {
+  .name = "sim",
+  .call_functions = &qnap_ec_sim_call_functions
+};
+static const struct qnap_ec_backend* qnap_ec_backends[] = { &qnap_ec_helper_backend,
+  &qnap_ec_daemon_backend, &qnap_ec_spawn_backend, &qnap_ec_it8528_backend, &qnap_ec_sim_backend };
+
+// Declare the selected backend structure pointer
+static const struct qnap_ec_backend* qnap_ec_selected_backend;
+
+// Define the simulated fan PWM values indexed by fan PWM group
+// Note: the simulated fan PWM groups are fan channels 0 through 5, 6 through 7, 20 through 25, and
+//       30 through 35 and the initial values match the values in the simulated libuLinux_hal
+//       library
+static uint32_t qnap_ec_sim_pwm_values[] = { 80, 90, 100, 650 };
+
+// Define the trusted valid fan, PWM, and temperature channel maps and whether they were supplied
+//   (either with the channel_map module parameter or by a known model)
+// Note: the maps hold one bit per channel and therefore can't hold more than 64 channels
+static unsigned long long qnap_ec_fan_channel_map;
+static unsigned long long qnap_ec_pwm_channel_map;
+static unsigned long long qnap_ec_temp_channel_map;
+static bool qnap_ec_channel_map_supplied;
+
+// Declare the known model structure pointer of the model recognized through its DMI information
+// Note: the it8528 backend only accesses the channels in this model's channel maps
+static const struct qnap_ec_model* qnap_ec_known_model;
 
 // Declare the platform driver structure pointer
 static struct platform_driver* qnap_ec_plat_driver;
@@ -121,21 +419,103 @@ static struct qnap_ec_devices* qnap_ec_devices;
 // Function called to initialize the driver
 static int __init qnap_ec_init(void)
 {
-  // Define static constant data consisting of the miscellaneous device file operations structure
+  // Define static constant data consisting of the miscellaneous device file operations structure,
+  //   the known model structures, and the known models DMI table
+  // Note: the known model channel maps are based on testing done on each model and only models
+  //       whose channels have been confirmed should be added
   static const struct file_operations misc_device_file_ops = {
     .owner = THIS_MODULE,
     .open = &qnap_ec_misc_device_open,
     .unlocked_ioctl = &qnap_ec_misc_device_ioctl,
+    .mmap = &qnap_ec_misc_device_mmap,
     .release = &qnap_ec_misc_device_release
   };
+  static const struct qnap_ec_model ts_673a_model = {
+    .fan_channel_map = 0x43,
+    .pwm_channel_map = 0x41,
+    .temp_channel_map = 0xE1
+  };
+  static const struct dmi_system_id dmi_table[] = {
+    {
+      .ident = "QNAP TS-673A",
+      .matches = {
+        DMI_MATCH(DMI_SYS_VENDOR, "QNAP"),
+        DMI_MATCH(DMI_PRODUCT_NAME, "TS-673A")
+      },
+      .driver_data = (void*)&ts_673a_model
+    },
+    { }
+  };
 
   // Declare needed variables
+  uint8_t i;
   int error;
+  int length = 0;
+  const struct dmi_system_id* dmi_system;
 
-  // Check if the embedded controll chip isn't present
-  error = qnap_ec_is_chip_present();
-  if (error)
-    return error;
+  // Loop through the backends and select the backend that should be used to access the embedded
+  //   controller chip
+  for (i = 0; i < ARRAY_SIZE(qnap_ec_backends); ++i)
+  {
+    if (strcmp(qnap_ec_backend, qnap_ec_backends[i]->name) == 0)
+    {
+      qnap_ec_selected_backend = qnap_ec_backends[i];
+      break;
+    }
+  }
+  if (qnap_ec_selected_backend == NULL)
+  {
+    pr_err("unknown backend (%s)", qnap_ec_backend);
+    return -EINVAL;
+  }
+
+  // Check if a trusted channel map was supplied and parse it
+  // Note: the whole string has to be consumed and no bits above the supported channels can be set
+  //       so that a mistyped channel map is rejected instead of being trusted (the shifts are split
+  //       in two so that they are valid when a map has exactly as many bits as there are channels)
+  if (qnap_ec_channel_map != NULL && qnap_ec_channel_map[0] != '\0')
+  {
+    if (sscanf(qnap_ec_channel_map, "fan=%llx,pwm=%llx,temp=%llx%n", &qnap_ec_fan_channel_map,
+        &qnap_ec_pwm_channel_map, &qnap_ec_temp_channel_map, &length) != 3 ||
+        length != strlen(qnap_ec_channel_map) ||
+        (qnap_ec_fan_channel_map >> (QNAP_EC_NUMBER_OF_FAN_CHANNELS - 1) >> 1) != 0 ||
+        (qnap_ec_pwm_channel_map >> (QNAP_EC_NUMBER_OF_PWM_CHANNELS - 1) >> 1) != 0 ||
+        (qnap_ec_temp_channel_map >> (QNAP_EC_NUMBER_OF_TEMP_CHANNELS - 1) >> 1) != 0)
+    {
+      pr_err("invalid channel map (%s)", qnap_ec_channel_map);
+      return -EINVAL;
+    }
+    qnap_ec_channel_map_supplied = true;
+  }
+
+  // Check if this is a known model and remember it
+  dmi_system = dmi_first_match(dmi_table);
+  if (dmi_system != NULL)
+    qnap_ec_known_model = dmi_system->driver_data;
+
+  // Check if no channel map was supplied and this is a known model and use its channel map
+  // Note: the channels are checked like on any other model if this isn't a known model
+  if (!qnap_ec_channel_map_supplied && qnap_ec_known_model != NULL)
+  {
+    qnap_ec_fan_channel_map = qnap_ec_known_model->fan_channel_map;
+    qnap_ec_pwm_channel_map = qnap_ec_known_model->pwm_channel_map;
+    qnap_ec_temp_channel_map = qnap_ec_known_model->temp_channel_map;
+    qnap_ec_channel_map_supplied = true;
+  }
+
+  // Check if we are using the it8528 backend on a model that isn't known and log that the helper
+  //   program will be used instead
+  if (qnap_ec_selected_backend == &qnap_ec_it8528_backend && qnap_ec_known_model == NULL)
+    pr_warn("it8528 backend has no confirmed channels for this model, using the helper program "
+      "instead");
+
+  // Check if we are not using the simulated backend and the embedded controll chip isn't present
+  if (qnap_ec_selected_backend != &qnap_ec_sim_backend)
+  {
+    error = qnap_ec_is_chip_present();
+    if (error)
+      return error;
+  }
 
   // Allocate memory for the platform driver structure and populate various fields
   qnap_ec_plat_driver = kzalloc(sizeof(struct platform_driver), GFP_KERNEL);
@@ -143,6 +523,7 @@ static int __init qnap_ec_init(void)
     return -ENOMEM;
   qnap_ec_plat_driver->driver.owner = THIS_MODULE;
   qnap_ec_plat_driver->driver.name = "qnap-ec";
+  qnap_ec_plat_driver->driver.probe_type = PROBE_PREFER_ASYNCHRONOUS;
   qnap_ec_plat_driver->probe = &qnap_ec_probe;
 
   // Register the driver
@@ -168,8 +549,9 @@ static int __init qnap_ec_init(void)
     return -ENOMEM;
   }
 
-  // Initialize the miscellaneous device mutex
-  mutex_init(&qnap_ec_devices->misc_device_mutex);
+  // Initialize the helper program daemon lock and the spawned helper program timeout work
+  spin_lock_init(&qnap_ec_devices->daemon_lock);
+  INIT_DELAYED_WORK(&qnap_ec_devices->spawn_timeout_work, &qnap_ec_spawn_helper_program_timeout);
 
   // Populate various miscellaneous device structure fields
   qnap_ec_devices->misc_device.name = "qnap-ec";
@@ -286,11 +668,88 @@ static int __init qnap_ec_is_chip_present(void)
 }
 
 // Function called to probe this driver
+// Note: the channels are discovered and the hwmon device is registered by the
+//       qnap_ec_discover_channels function in a worker so that probing (and therefore loading the
+//       module) doesn't wait for the hundreds of libuLinux_hal library function calls needed to
+//       check every channel
 static int qnap_ec_probe(struct platform_device* platform_dev)
+{
+  // Declare needed variables
+  uint8_t i;
+  int error;
+  struct qnap_ec_data* data;
+
+  // Allocate device managed memory for the data structure
+  data = devm_kzalloc(&platform_dev->dev, sizeof(struct qnap_ec_data), GFP_KERNEL);
+  if (data == NULL)
+    return -ENOMEM;
+
+  // Initialize the write and transport mutexes and values sequence lock, set the devices pointer,
+  //   and if we are simulating the PWM enable attribute set the PWM enable values
+  mutex_init(&data->write_mutex);
+  mutex_init(&data->transport_mutex);
+  seqlock_init(&data->values_lock);
+  data->devices = qnap_ec_devices;
+  if (qnap_ec_sim_pwm_enable)
+    for (i = 0; i < QNAP_EC_NUMBER_OF_PWM_CHANNELS / 8; ++i)
+      data->pwm_enable_value_field[i] = 0xFF;
+
+  // Check if a trusted channel map was supplied and mark all the channels as checked and the
+  //   channels in the map as valid so that no channels need to be checked
+  if (qnap_ec_channel_map_supplied)
+  {
+    for (i = 0; i < QNAP_EC_NUMBER_OF_FAN_CHANNELS; ++i)
+      if (((qnap_ec_fan_channel_map >> i) & 0x01) == 1)
+        set_bit(i, data->fan_channel_valid_field);
+    for (i = 0; i < QNAP_EC_NUMBER_OF_PWM_CHANNELS; ++i)
+      if (((qnap_ec_pwm_channel_map >> i) & 0x01) == 1)
+        set_bit(i, data->pwm_channel_valid_field);
+    for (i = 0; i < QNAP_EC_NUMBER_OF_TEMP_CHANNELS; ++i)
+      if (((qnap_ec_temp_channel_map >> i) & 0x01) == 1)
+        set_bit(i, data->temp_channel_valid_field);
+    bitmap_fill(data->fan_channel_checked_field, QNAP_EC_NUMBER_OF_FAN_CHANNELS);
+    bitmap_fill(data->pwm_channel_checked_field, QNAP_EC_NUMBER_OF_PWM_CHANNELS);
+    bitmap_fill(data->temp_channel_checked_field, QNAP_EC_NUMBER_OF_TEMP_CHANNELS);
+  }
+
+  // Set the custom device data to the data structure
+  // Note: this needs to be done before registering the hwmon device so that the data is accessible
+  //       in the qnap_ec_is_visible function which is called when the hwmon device is registered
+  dev_set_drvdata(&platform_dev->dev, data);
+
+  // Allocate the work queue used by the background refresh and the poller
+  // Note: we are using our own work queue instead of a system work queue since the background
+  //       refresh and the poller can block for as long as the call timeout when the helper program
+  //       hangs which would otherwise tie up shared system workers
+  data->work_queue = alloc_ordered_workqueue("qnap-ec", 0);
+  if (data->work_queue == NULL)
+    return -ENOMEM;
+
+  // Initialize the discovery, background refresh, and poller work structures and make sure the
+  //   discovery is finished, the hwmon device is unregistered, the other work is cancelled, and the
+  //   work queue is destroyed before the data structure is freed when the platform device is
+  //   removed
+  INIT_WORK(&data->discovery_work, &qnap_ec_discover_channels);
+  INIT_WORK(&data->refresh_work, &qnap_ec_refresh_stale_values);
+  INIT_DELAYED_WORK(&data->poll_work, &qnap_ec_poll_sensors);
+  error = devm_add_action_or_reset(&platform_dev->dev, &qnap_ec_remove, data);
+  if (error)
+    return error;
+
+  // Start discovering the channels
+  // Note: we are using the long running work queue since discovering the channels can take several
+  //       seconds
+  queue_work(system_long_wq, &data->discovery_work);
+
+  return 0;
+}
+
+// Function called to discover the valid channels and register the hwmon device once they are known
+static void qnap_ec_discover_channels(struct work_struct* work)
 {
   // Define static non constant and constant data consisiting of mulitple configuration arrays,
-  //   multiple hwmon channel info structures, the hwmon channel info structures array, and the
-  //   hwmon chip information structure
+  //   multiple hwmon channel info structures, the hwmon channel info structures array, the hwmon
+  //   chip information structure, and the extra sysfs attribute structures
   static u32 fan_config[QNAP_EC_NUMBER_OF_FAN_CHANNELS + 1];
   static u32 pwm_config[QNAP_EC_NUMBER_OF_PWM_CHANNELS + 1];
   static u32 temp_config[QNAP_EC_NUMBER_OF_TEMP_CHANNELS + 1];
@@ -317,29 +776,38 @@ static int qnap_ec_probe(struct platform_device* platform_dev)
     .info = hwmon_channel_info,
     .ops = &hwmon_ops
   };
+  static struct device_attribute stale_reads_attribute = {
+    .attr = {
+      .name = "stale_reads",
+      .mode = 0444
+    },
+    .show = &qnap_ec_show_stale_reads
+  };
+  static struct device_attribute timed_out_calls_attribute = {
+    .attr = {
+      .name = "timed_out_calls",
+      .mode = 0444
+    },
+    .show = &qnap_ec_show_timed_out_calls
+  };
+  static struct device_attribute channel_map_attribute = {
+    .attr = {
+      .name = "channel_map",
+      .mode = 0444
+    },
+    .show = &qnap_ec_show_channel_map
+  };
+  static struct attribute* attributes[] = { &stale_reads_attribute.attr,
+    &timed_out_calls_attribute.attr, &channel_map_attribute.attr, NULL };
+  static const struct attribute_group attribute_group = {
+    .attrs = attributes
+  };
+  static const struct attribute_group* attribute_groups[] = { &attribute_group, NULL };
 
-  // Declare needed variables
+  // Declare and/or define needed variables
   uint8_t i;
-  struct qnap_ec_data* data;
   struct device* device;
-
-  // Allocate device managed memory for the data structure
-  data = devm_kzalloc(&platform_dev->dev, sizeof(struct qnap_ec_data), GFP_KERNEL);
-  if (data == NULL)
-    return -ENOMEM;
-
-  // Initialize the data mutex, set the devices pointer, and if we are simulating the PWM enable
-  //   attribute set the PWM enable values
-  mutex_init(&data->mutex);
-  data->devices = qnap_ec_devices;
-  if (qnap_ec_sim_pwm_enable)
-    for (i = 0; i < QNAP_EC_NUMBER_OF_PWM_CHANNELS / 8; ++i)
-      data->pwm_enable_value_field[i] = 0xFF;
-
-  // Set the custom device data to the data structure
-  // Note: this needs to be done before registering the hwmon device so that the data is accessible
-  //       in the qnap_ec_is_visible function which is called when the hwmon device is registered
-  dev_set_drvdata(&platform_dev->dev, data);
+  struct qnap_ec_data* data = container_of(work, struct qnap_ec_data, discovery_work);
 
   // Populate the fan configuration array
   for (i = 0; i < QNAP_EC_NUMBER_OF_FAN_CHANNELS; ++i)
@@ -360,14 +828,35 @@ static int qnap_ec_probe(struct platform_device* platform_dev)
     temp_config[i] = HWMON_T_INPUT;
   temp_config[i] = 0;
 
-  // Register the hwmon device and pass in the data structure
-  // Note: hwmon device name cannot contain dashes
-  device = devm_hwmon_device_register_with_info(&platform_dev->dev, "qnap_ec", data,
-    &hwmon_chip_info, NULL);
-  if (device == NULL)
-    return -ENOMEM;
+  // Loop through all the channels and check if they are valid
+  // Note: the results are kept in the checked and valid fields so the qnap_ec_hwmon_is_visible
+  //       function doesn't need to call any libuLinux_hal library functions when the hwmon device
+  //       is registered
+  for (i = 0; i < QNAP_EC_NUMBER_OF_FAN_CHANNELS; ++i)
+    qnap_ec_is_fan_channel_valid(data, i);
+  for (i = 0; i < QNAP_EC_NUMBER_OF_PWM_CHANNELS; ++i)
+    qnap_ec_is_pwm_channel_valid(data, i);
+  for (i = 0; i < QNAP_EC_NUMBER_OF_TEMP_CHANNELS; ++i)
+    qnap_ec_is_temp_channel_valid(data, i);
+
+  // Register the hwmon device and pass in the data structure and the extra sysfs attributes
+  // Note: hwmon device name cannot contain dashes and we are not using the device managed version
+  //       of this function since device managed resources can't safely be added outside of the
+  //       probe function while the platform device could be removed at the same time
+  device = hwmon_device_register_with_info(&data->devices->plat_device->dev, "qnap_ec", data,
+    &hwmon_chip_info, attribute_groups);
+  if (IS_ERR(device))
+  {
+    pr_err("unable to register hwmon device (%ld)", PTR_ERR(device));
+    return;
+  }
+  data->hwmon_device = device;
 
-  return 0;
+  // Check if background polling is enabled and start the poller
+  // Note: all the channels have been checked by the time the hwmon device is registered so the
+  //       poller can rely on the valid fields
+  if (qnap_ec_poll_interval != 0)
+    queue_delayed_work(data->work_queue, &data->poll_work, 0);
 }
 
 // Function called to check if a hwmon attribute is visible
@@ -440,10 +929,7 @@ static umode_t qnap_ec_hwmon_is_visible(const void* const_data, enum hwmon_senso
 static int qnap_ec_hwmon_read(struct device* device, enum hwmon_sensor_types type, u32 attribute,
                               int channel, long* value)
 {
-  // Declare and/or define needed variables
-  uint32_t fan_speed;
-  uint32_t fan_pwm;
-  int64_t temperature;
+  // Define needed variables
   struct qnap_ec_data* data = dev_get_drvdata(device);
 
   // Switch based on the sensor type
@@ -459,13 +945,11 @@ static int qnap_ec_hwmon_read(struct device* device, enum hwmon_sensor_types typ
           if (!qnap_ec_is_fan_channel_valid(data, channel))
             return -EOPNOTSUPP;
 
-          // Call the ec_sys_get_fan_speed function in the libuLinux_hal library
-          if (qnap_ec_call_lib_function(true, data, int8_func_uint8_uint32pointer,
-              "ec_sys_get_fan_speed", channel, NULL, &fan_speed, NULL, true) != 0)
+          // Get the fan speed from the snapshot or if it's not in the snapshot from the cache or the
+          //   ec_sys_get_fan_speed function in the libuLinux_hal library
+          if (!qnap_ec_read_snapshot_value(data, hwmon_fan, channel, value) &&
+              qnap_ec_read_cached_value(data, hwmon_fan, channel, value) != 0)
             return -ENODATA;
-  
-          // Set the value to the returned fan speed
-          *value = fan_speed;
 
           break;
         default:
@@ -491,14 +975,12 @@ static int qnap_ec_hwmon_read(struct device* device, enum hwmon_sensor_types typ
           if (!qnap_ec_is_pwm_channel_valid(data, channel))
             return -EOPNOTSUPP;
 
-          // Call the ec_sys_get_fan_pwm function in the libuLinux_hal library
-          if (qnap_ec_call_lib_function(true, data, int8_func_uint8_uint32pointer,
-              "ec_sys_get_fan_pwm", channel, NULL, &fan_pwm, NULL, true) != 0)
+          // Get the fan PWM from the snapshot or if it's not in the snapshot from the cache or the
+          //   ec_sys_get_fan_pwm function in the libuLinux_hal library
+          if (!qnap_ec_read_snapshot_value(data, hwmon_pwm, channel, value) &&
+              qnap_ec_read_cached_value(data, hwmon_pwm, channel, value) != 0)
             return -ENODATA;
 
-          // Set the value to the returned fan PWM
-          *value = fan_pwm;
-
           break;
         default:
           return -EOPNOTSUPP;
@@ -514,22 +996,12 @@ static int qnap_ec_hwmon_read(struct device* device, enum hwmon_sensor_types typ
           if (!qnap_ec_is_temp_channel_valid(data, channel))
             return -EOPNOTSUPP;
 
-          // Call the ec_sys_get_temperature function in the libuLinux_hal library
-          // Note: we are using an int64 variable instead of a double variable because floating
-          //       point math (including casting) is not possible in kernel space
-          if (qnap_ec_call_lib_function(true, data, int8_func_uint8_doublepointer,
-              "ec_sys_get_temperature", channel, NULL, NULL, &temperature, true) != 0)
+          // Get the temperature from the snapshot or if it's not in the snapshot from the cache or the
+          //   ec_sys_get_temperature function in the libuLinux_hal library
+          if (!qnap_ec_read_snapshot_value(data, hwmon_temp, channel, value) &&
+              qnap_ec_read_cached_value(data, hwmon_temp, channel, value) != 0)
             return -ENODATA;
 
-          // Set the value to the returned temperature
-          // Note: because an int64 variable can hold a 19 digit integer while a double variable can
-          //       hold a 16 digit integer without loosing precision in the helper program we
-          //       multiple the double value by 1000 to move three digits after the decimal point to
-          //       before the decimal point and still fit the value in an int64 variable and
-          //       preserve three digits after the decimal point however because we need to return a
-          //       millidegree value there is no need to divide by 1000
-          *value = temperature;
-
           break;
         default:
           return -EOPNOTSUPP;
@@ -568,6 +1040,9 @@ static int qnap_ec_hwmon_write(struct device* device, enum hwmon_sensor_types ty
           if (value < 0 || value > 1)
             return -EOPNOTSUPP;
 
+          // Get the write mutex lock
+          mutex_lock(&data->write_mutex);
+
           // Check if the value is 0
           if (value == 0)
           {
@@ -577,9 +1052,17 @@ static int qnap_ec_hwmon_write(struct device* device, enum hwmon_sensor_types ty
             // Set the fan PWM to full and call the ec_sys_set_fan_speed function in the
             //   libuLinux_hal library
             fan_pwm = 255;
-            if (qnap_ec_call_lib_function(true, data, int8_func_uint8_uint8,
-                "ec_sys_set_fan_speed", channel, &fan_pwm, NULL, NULL, true) != 0)
+            if (qnap_ec_call_lib_function(true, data, func_ec_sys_set_fan_speed, channel,
+                &fan_pwm, NULL, NULL, true) != 0)
+            {
+              // Release the write mutex lock
+              mutex_unlock(&data->write_mutex);
+
               return -EOPNOTSUPP;
+            }
+
+            // Invalidate the cached fan PWM values
+            qnap_ec_invalidate_cached_pwm_values(data);
           }
           else // if (value == 1)
           {
@@ -587,6 +1070,9 @@ static int qnap_ec_hwmon_write(struct device* device, enum hwmon_sensor_types ty
             data->pwm_enable_value_field[channel / 8] |= (0x01 << (channel % 8));
           }
 
+          // Release the write mutex lock
+          mutex_unlock(&data->write_mutex);
+
           break;
         case hwmon_pwm_input:
           // Check if this PWM channel is invalid or if we are simulating the PWM enable attribute
@@ -599,10 +1085,21 @@ static int qnap_ec_hwmon_write(struct device* device, enum hwmon_sensor_types ty
           if (value < 0 || value > 255)
             return -EOVERFLOW;
 
-          // Call the ec_sys_set_fan_speed function in the libuLinux_hal library
-          if (qnap_ec_call_lib_function(true, data, int8_func_uint8_uint8, "ec_sys_set_fan_speed",
-              channel, &fan_pwm, NULL, NULL, true) != 0)
+          // Get the write mutex lock and call the ec_sys_set_fan_speed function in the
+          //   libuLinux_hal library
+          mutex_lock(&data->write_mutex);
+          if (qnap_ec_call_lib_function(true, data, func_ec_sys_set_fan_speed, channel,
+              &fan_pwm, NULL, NULL, true) != 0)
+          {
+            // Release the write mutex lock
+            mutex_unlock(&data->write_mutex);
+
             return -EOPNOTSUPP;
+          }
+
+          // Invalidate the cached fan PWM values and release the write mutex lock
+          qnap_ec_invalidate_cached_pwm_values(data);
+          mutex_unlock(&data->write_mutex);
 
           break;
         default:
@@ -617,364 +1114,876 @@ static int qnap_ec_hwmon_write(struct device* device, enum hwmon_sensor_types ty
   return 0;
 }
 
-// Function called to check if the fan channel number is valid
-static bool qnap_ec_is_fan_channel_valid(struct qnap_ec_data* data, uint8_t channel)
+// Function called to show the number of hwmon reads that returned stale cached values
+static ssize_t qnap_ec_show_stale_reads(struct device* device, struct device_attribute* attribute,
+                                        char* buffer)
 {
-  // Note: based on testing the logic to determining if a fan channel is valid is:
-  //       - call the ec_sys_get_fan_status function in the libuLinux_hal library
-  //       - if the function return value is non zero then the channel is invalid
-  //       - if the returned fan status is non zero then the channel is invalid
-  //       - call the ec_sys_get_fan_speed function in the libuLinux_hal library
-  //       - if the function return value is non zero then the channel is invalid
-  //       - if the returned fan speed is 65535 then the channel is invalid
-  //       - call the ec_sys_get_fan_pwm function in the libuLinux_hal library
-  //       - if the function return value is non zero then the channel is invalid
-  //       - if the returned fan PWM is greater than 255 then the channel is invalid
-  //       - mark the channel as valid
-
-  // Declare needed variables
-  uint32_t fan_status;
-  uint32_t fan_speed;
-  uint32_t fan_pwm;
+  // Define needed variables
+  struct qnap_ec_data* data = dev_get_drvdata(device);
 
-  // Check if this channel has already been checked
-  if (((data->fan_channel_checked_field[channel / 8] >> (channel % 8)) & 0x01) == 1)
-  {
-    // Check if this channel is invalid
-    if (((data->fan_channel_valid_field[channel / 8] >> (channel % 8)) & 0x01) == 0)
-      return false;
+  return sysfs_emit(buffer, "%ld\n", atomic_long_read(&data->stale_reads));
+}
 
-    return true;
-  }
+// Function called to show the number of batches of library function calls that timed out
+static ssize_t qnap_ec_show_timed_out_calls(struct device* device,
+                                            struct device_attribute* attribute, char* buffer)
+{
+  // Define needed variables
+  struct qnap_ec_data* data = dev_get_drvdata(device);
 
-  // Get the data mutex lock
-  mutex_lock(&data->mutex);
+  return sysfs_emit(buffer, "%ld\n", atomic_long_read(&data->timed_out_calls));
+}
 
-  // Set the fan status to an invalid value (to verify that the called function changed the value)
-  //   and call the ec_sys_get_fan_status function in the libuLinux_hal library
-  fan_status = 1;
-  if (qnap_ec_call_lib_function(false, data, int8_func_uint8_uint32pointer, "ec_sys_get_fan_status",
-      channel, NULL, &fan_status, NULL, false) != 0)
-  {
-    // Mark this channel as checked (and invalid by default)
-    data->fan_channel_checked_field[channel / 8] |= (0x01 << (channel % 8));
+// Function called to show the valid channel map sysfs attribute
+// Note: the map is shown in the same format the channel_map module parameter accepts so that it can
+//       be passed back in when the module is loaded again on the same model
+static ssize_t qnap_ec_show_channel_map(struct device* device, struct device_attribute* attribute,
+                                        char* buffer)
+{
+  // Declare and/or define needed variables
+  uint8_t i;
+  unsigned long long fan_map = 0;
+  unsigned long long pwm_map = 0;
+  unsigned long long temp_map = 0;
+  struct qnap_ec_data* data = dev_get_drvdata(device);
 
-    // Release the data mutex lock
-    mutex_unlock(&data->mutex);
+  // Convert the valid bitmaps into maps
+  for (i = 0; i < QNAP_EC_NUMBER_OF_FAN_CHANNELS; ++i)
+    if (test_bit(i, data->fan_channel_valid_field))
+      fan_map |= 1ULL << i;
+  for (i = 0; i < QNAP_EC_NUMBER_OF_PWM_CHANNELS; ++i)
+    if (test_bit(i, data->pwm_channel_valid_field))
+      pwm_map |= 1ULL << i;
+  for (i = 0; i < QNAP_EC_NUMBER_OF_TEMP_CHANNELS; ++i)
+    if (test_bit(i, data->temp_channel_valid_field))
+      temp_map |= 1ULL << i;
 
-    return false;
-  }
+  return sysfs_emit(buffer, "fan=0x%llx,pwm=0x%llx,temp=0x%llx\n", fan_map, pwm_map, temp_map);
+}
 
-  // Check if the returned status is non zero
-  if (fan_status != 0)
+// Function called to read a fan speed, fan PWM, or temperature value from the cache or from the
+//   libuLinux_hal library if the cached value is older than the sensor type's cache TTL
+// Note: if the cached value is older than the cache TTL but not older than the cache TTL plus the
+//       maximum staleness the cached value is returned right away and the cached values of the
+//       sensor type are refreshed in the background so that the caller never waits for the helper
+//       program
+// Note: the return value is the same as the return value of the qnap_ec_call_lib_function function
+static int qnap_ec_read_cached_value(struct qnap_ec_data* data, enum hwmon_sensor_types type,
+                                     uint8_t channel, long* value)
+{
+  // Declare needed variables
+  int return_value;
+  unsigned int sequence;
+  bool valid;
+  long cached_value;
+  unsigned long cached_jiffies;
+  unsigned long generation;
+  unsigned long ttl;
+  unsigned long now;
+  struct qnap_ec_cached_value* cached_values;
+
+  // Switch based on the sensor type and get the cache TTL and the cached values for the sensor type
+  switch (type)
   {
-    // Mark this channel as checked (and invalid by default)
-    data->fan_channel_checked_field[channel / 8] |= (0x01 << (channel % 8));
-
-    // Release the data mutex lock
-    mutex_unlock(&data->mutex);
-
-    return false;
-  }
+    case hwmon_fan:
+      ttl = msecs_to_jiffies(qnap_ec_fan_cache_ttl);
+      cached_values = data->fan_cached_values;
 
-  // Set the fan speed to an invalid value (to verify that the called function changed the value)
-  //   and call the ec_sys_get_fan_speed function in the libu_Linux_hal library
-  fan_speed = 65535;
-  if (qnap_ec_call_lib_function(false, data, int8_func_uint8_uint32pointer, "ec_sys_get_fan_speed",
-      channel, NULL, &fan_speed, NULL, false) != 0)
-  {
-    // Mark this channel as checked (and invalid by default)
-    data->fan_channel_checked_field[channel / 8] |= (0x01 << (channel % 8));
+      break;
+    case hwmon_pwm:
+      ttl = msecs_to_jiffies(qnap_ec_pwm_cache_ttl);
+      cached_values = data->pwm_cached_values;
 
-    // Release the data mutex lock
-    mutex_unlock(&data->mutex);
+      break;
+    case hwmon_temp:
+      ttl = msecs_to_jiffies(qnap_ec_temp_cache_ttl);
+      cached_values = data->temp_cached_values;
 
-    return false;
+      break;
+    default:
+      return -EOPNOTSUPP;
   }
 
-  // Check if the returned fan speed is 65535
-  if (fan_speed == 65535)
+  // Get the cached value without getting the transport mutex lock so that readers of cached
+  //   values never wait for another thread that is refreshing values
+  do
   {
-    // Mark this channel as checked (and invalid by default)
-    data->fan_channel_checked_field[channel / 8] |= (0x01 << (channel % 8));
-
-    // Release the data mutex lock
-    mutex_unlock(&data->mutex);
+    sequence = read_seqbegin(&data->values_lock);
+    valid = cached_values[channel].valid;
+    cached_jiffies = cached_values[channel].jiffies;
+    cached_value = cached_values[channel].value;
+    generation = cached_values[channel].generation;
+  } while (read_seqretry(&data->values_lock, sequence));
+
+  // Check if the cached value is still fresh
+  now = jiffies;
+  if (valid && time_before(now, cached_jiffies + ttl))
+  {
+    // Set the value to the cached value
+    *value = cached_value;
 
-    return false;
+    return 0;
   }
 
-  // Set the fan PWM to an invalid value (to verify that the called function changed the value)
-  //   and call the ec_sys_get_fan_pwm function in the libuLinux_hal library
-  fan_pwm = 256;
-  if (qnap_ec_call_lib_function(false, data, int8_func_uint8_uint32pointer, "ec_sys_get_fan_pwm",
-      channel, NULL, &fan_pwm, NULL, false) != 0)
+  // Check if caching and returning stale values are enabled and the cached value is not older than
+  //   the maximum staleness
+  if (valid && ttl != 0 && qnap_ec_max_stale != 0 && time_before(now, cached_jiffies + ttl +
+      msecs_to_jiffies(qnap_ec_max_stale)))
   {
-    // Mark this channel as checked (and invalid by default)
-    data->fan_channel_checked_field[channel / 8] |= (0x01 << (channel % 8));
+    // Set the value to the stale cached value and count the stale read
+    *value = cached_value;
+    atomic_long_inc(&data->stale_reads);
 
-    // Release the data mutex lock
-    mutex_unlock(&data->mutex);
+    // Mark the sensor type as needing a refresh and schedule the background refresh
+    // Note: the queue_work function does nothing if the background refresh is already queued so
+    //       there is at most one background refresh pending at a time
+    set_bit(type, &data->stale_types);
+    queue_work(data->work_queue, &data->refresh_work);
 
-    return false;
+    return 0;
   }
 
-  // Check if the returned fan PWM is greater than 255
-  if (fan_pwm > 255)
+  // Get the transport mutex lock
+  mutex_lock(&data->transport_mutex);
+
+  // Check if another thread completed a call for this channel while we were waiting for the
+  //   transport mutex lock in which case that call was in flight at the same time as this read and
+  //   we share its result instead of making an identical call (even if caching is disabled)
+  if (cached_values[channel].generation != generation)
   {
-    // Mark this channel as checked (and invalid by default)
-    data->fan_channel_checked_field[channel / 8] |= (0x01 << (channel % 8));
+    // Set the value to the shared value and get the shared return value
+    return_value = cached_values[channel].return_value;
+    if (return_value == 0)
+      *value = cached_values[channel].value;
 
-    // Release the data mutex lock
-    mutex_unlock(&data->mutex);
+    // Release the transport mutex lock
+    mutex_unlock(&data->transport_mutex);
 
-    return false;
+    return return_value;
   }
 
-  // Mark this channel as checked and valid
-  data->fan_channel_checked_field[channel / 8] |= (0x01 << (channel % 8));
-  data->fan_channel_valid_field[channel / 8] |= (0x01 << (channel % 8));
+  // Refresh the cached values and set the value to the refreshed value
+  return_value = qnap_ec_refresh_cached_values(data, type, channel);
+  if (return_value == 0)
+    *value = cached_values[channel].value;
 
-  // Release the data mutex lock
-  mutex_unlock(&data->mutex);
+  // Release the transport mutex lock
+  mutex_unlock(&data->transport_mutex);
 
-  return true;
+  return return_value;
 }
 
-// Function called to check if the PWM channel number is valid
-static bool qnap_ec_is_pwm_channel_valid(struct qnap_ec_data* data, uint8_t channel)
+// Function called to refresh the cached values of a sensor type
+// Note: the channel's value is refreshed along with the values of all the other valid channels of
+//       the same sensor type whose cached values are too old in one batch since programs reading
+//       the hwmon attributes usually read all the channels one after another and if the channel
+//       is negative only the values that are too old are refreshed
+// Note: the transport mutex must be locked when calling this function and the return value is the
+//       same as the return value of the qnap_ec_call_lib_function function for the channel
+static int qnap_ec_refresh_cached_values(struct qnap_ec_data* data, enum hwmon_sensor_types type,
+                                         int channel)
 {
-  // Note: based on testing the logic to determine if a PWM channel is valid is:
-  //       - loop through all channels that have not been checked and read the initial fan PWM by
-  //         calling the ec_sys_get_fan_speed function in the libuLinux_hal library
-  //       - if the function return value is non zero for a channel then the channel is invalid
-  //       - if the returned fan PWM for a channel is greater than 255 then the channel is invalid
-  //       - call the ec_sys_set_fan_speed function in the libuLinux_hal library to
-  //         increase/decrease the fan PWM
-  //       - if the function return value is non zero then the channel is invalid
-  //       - loop through all channels that have not been checked and have the same initial fan PWM
-  //         as the channel being validated and read the changed fan PWM by calling the
-  //         ec_sys_get_fan_speed function in the libuLinux_hal library
-  //       - if the function return value is non zero for a channel then the channel is invalid
-  //       - if the returned fan PWM for a channel is greater than 255 then the channel is invalid
-  //       - call the ec_sys_set_fan_speed function in the libuLinux_hal library to reset the fan
-  //         PWM
-  //       - if the function return value is non zero then the channel is invalid
-  //       - loop through all channels that have not been checked and have the same initial fan PWM
-  //         as the channel being validated and have the same changed fan PWM as the channel being
-  //         validated and mark the lowest numerical channel as valid and mark the other
-  //         channels as invalid
-
-  // Declare and/or define needed variables
+  // Declare needed variables
   uint8_t i;
-  uint8_t fan_pwm;
-  uint32_t fan_speed;
-  bool valid_channel_marked = false;
-  uint8_t initial_fan_pwms[QNAP_EC_NUMBER_OF_PWM_CHANNELS];
-  uint8_t changed_fan_pwms[QNAP_EC_NUMBER_OF_PWM_CHANNELS];
+  uint8_t queued_channel;
+  int return_value;
+  unsigned long ttl;
+  unsigned long now;
+  uint8_t number_of_channels;
+  unsigned long* valid_field;
+  enum qnap_ec_ioctl_function function;
+  struct qnap_ec_cached_value* cached_values;
+  struct qnap_ec_ioctl_command* command;
+
+  // Switch based on the sensor type and get the cache TTL, the libuLinux_hal library function,
+  //   and the cached values for the sensor type
+  switch (type)
+  {
+    case hwmon_fan:
+      ttl = msecs_to_jiffies(qnap_ec_fan_cache_ttl);
+      function = func_ec_sys_get_fan_speed;
+      number_of_channels = QNAP_EC_NUMBER_OF_FAN_CHANNELS;
+      valid_field = data->fan_channel_valid_field;
+      cached_values = data->fan_cached_values;
 
-  // Check if we should not be validating PWM channels and should mimic the fan channels
-  if (!qnap_ec_val_pwm_channels)
-    return qnap_ec_is_fan_channel_valid(data, channel);
+      break;
+    case hwmon_pwm:
+      ttl = msecs_to_jiffies(qnap_ec_pwm_cache_ttl);
+      function = func_ec_sys_get_fan_pwm;
+      number_of_channels = QNAP_EC_NUMBER_OF_PWM_CHANNELS;
+      valid_field = data->pwm_channel_valid_field;
+      cached_values = data->pwm_cached_values;
 
-  // Check if this channel has already been checked
-  if (((data->pwm_channel_checked_field[channel / 8] >> (channel % 8)) & 0x01) == 1)
-  {
-    // Check if this channel is invalid
-    if (((data->pwm_channel_valid_field[channel / 8] >> (channel % 8)) & 0x01) == 0)
-      return false;
+      break;
+    case hwmon_temp:
+      ttl = msecs_to_jiffies(qnap_ec_temp_cache_ttl);
+      function = func_ec_sys_get_temperature;
+      number_of_channels = QNAP_EC_NUMBER_OF_TEMP_CHANNELS;
+      valid_field = data->temp_channel_valid_field;
+      cached_values = data->temp_cached_values;
 
-    return true;
+      break;
+    default:
+      return -EOPNOTSUPP;
   }
 
-  // Get the data mutex lock
-  mutex_lock(&data->mutex);
-
-  // Read the intial fan PWMs
-  if (qnap_ec_is_pwm_channel_valid_read_fan_pwms(data, channel, initial_fan_pwms, NULL) != 0)
+  // Add a call to the libuLinux_hal library function for the channel to the batch followed by
+  //   calls for all the other valid channels whose cached values are too old if caching is enabled
+  now = jiffies;
+  data->ioctl_batch.number_of_commands = 0;
+  if (channel >= 0)
+    qnap_ec_queue_lib_function(data, function, channel, 0, 0, 0);
+  for (i = 0; ttl != 0 && i < number_of_channels; ++i)
   {
-    // Mark this channel as checked (and invalid by default)
-    data->pwm_channel_checked_field[channel / 8] |= (0x01 << (channel % 8));
-
-    // Release the data mutex lock
-    mutex_unlock(&data->mutex);
+    // Check if this is the channel, if this channel is invalid, or if this channel's cached value
+    //   is still fresh
+    if (i == channel || !test_bit(i, valid_field) || (cached_values[i].valid &&
+        time_before(now, cached_values[i].jiffies + ttl)))
+      continue;
 
-    return false;
+    // Add the call to the batch
+    if (qnap_ec_queue_lib_function(data, function, i, 0, 0, 0) < 0)
+      break;
   }
 
-  // Check if the initial fan PWM is less than or equal to 250 and change the fan PWM accordingly
-  if (initial_fan_pwms[channel] <= 250)
-    fan_pwm = initial_fan_pwms[channel] + 5;
-  else
-    fan_pwm = initial_fan_pwms[channel] - 5;
+  // Call the functions
+  return_value = qnap_ec_call_lib_functions(data);
 
-  // Call the ec_sys_set_fan_speed function in the libuLinux_hal library
-  if (qnap_ec_call_lib_function(false, data, int8_func_uint8_uint8, "ec_sys_set_fan_speed", channel,
-      &fan_pwm, NULL, NULL, false) != 0)
+  // Loop through the commands and save the results in the cache
+  // Note: temperatures are returned as int64 values that were multiplied by 1000 in the helper
+  //       program (see the notes in the helper program) which already are millidegree values
+  now = jiffies;
+  write_seqlock(&data->values_lock);
+  for (i = 0; i < data->ioctl_batch.number_of_commands; ++i)
   {
-    // Mark this channel as checked (and invalid by default)
-    data->pwm_channel_checked_field[channel / 8] |= (0x01 << (channel % 8));
-
-    // Release the data mutex lock
-    mutex_unlock(&data->mutex);
+    // Mark the call for this command's queued channel as completed
+    command = &data->ioctl_batch.commands[i];
+    queued_channel = data->ioctl_batch_channels[i];
+    ++cached_values[queued_channel].generation;
+
+    // Check if the call or the function returned an error, save the error, and invalidate the
+    //   cached value
+    if (return_value != 0 || command->return_value_int8 != 0)
+    {
+      cached_values[queued_channel].return_value = return_value != 0 ? return_value :
+        command->return_value_int8;
+      cached_values[queued_channel].valid = false;
+      continue;
+    }
 
-    return false;
+    // Save the returned value
+    cached_values[queued_channel].value = type == hwmon_temp ? command->argument2_int64 :
+      command->argument2_uint32;
+    cached_values[queued_channel].jiffies = now;
+    cached_values[queued_channel].valid = true;
+    cached_values[queued_channel].return_value = 0;
   }
+  write_sequnlock(&data->values_lock);
 
-  // Read the changed fan PWMs
-  if (qnap_ec_is_pwm_channel_valid_read_fan_pwms(data, channel, initial_fan_pwms,
-      changed_fan_pwms) != 0)
-  {
-    // Mark this channel as checked (and invalid by default)
-    data->pwm_channel_checked_field[channel / 8] |= (0x01 << (channel % 8));
-
-    // Release the data mutex lock
-    mutex_unlock(&data->mutex);
-
-    return false;
-  }
+  // Check if the call returned an error
+  if (return_value != 0)
+    return return_value;
 
-  // Check if the fan PWM didn't actually change
-  if (initial_fan_pwms[channel] == changed_fan_pwms[channel])
+  // Check if the function called for the channel returned an error
+  command = &data->ioctl_batch.commands[0];
+  if (channel >= 0 && command->return_value_int8 != 0)
   {
-    // Mark this channel as checked (and invalid by default)
-    data->pwm_channel_checked_field[channel / 8] |= (0x01 << (channel % 8));
-
-    // Release the data mutex lock
-    mutex_unlock(&data->mutex);
+    // Log the error
+    pr_err("libuLinux_hal library %s function called by qnap-ec helper program returned a non "
+      "zero value (%i)", qnap_ec_ioctl_function_names[function], command->return_value_int8);
 
-    return false;
+    return command->return_value_int8;
   }
 
-  // Set the fan PWM to the initial fan PWM and call the ec_sys_set_fan_speed function in the
-  //   libuLinux_hal library
-  fan_pwm = initial_fan_pwms[channel];
-  if (qnap_ec_call_lib_function(false, data, int8_func_uint8_uint8, "ec_sys_set_fan_speed", channel,
-      &fan_pwm, NULL, NULL, false) != 0)
-  {
-    // Mark this channel as checked (and invalid by default)
-    data->pwm_channel_checked_field[channel / 8] |= (0x01 << (channel % 8));
+  return 0;
+}
 
-    // Release the data mutex lock
-    mutex_unlock(&data->mutex);
+// Function called by the work queue to refresh the cached values of the sensor types that
+//   had stale cached values returned by the qnap_ec_read_cached_value function
+static void qnap_ec_refresh_stale_values(struct work_struct* work)
+{
+  // Define static constant data consisting of the cached sensor types
+  static const enum hwmon_sensor_types types[] = { hwmon_fan, hwmon_pwm, hwmon_temp };
 
-    return false;
-  }
+  // Declare and/or define needed variables
+  uint8_t i;
+  struct qnap_ec_data* data = container_of(work, struct qnap_ec_data, refresh_work);
 
-  // Loop through all the channels
-  for (i = 0; i < QNAP_EC_NUMBER_OF_PWM_CHANNELS; ++i)
+  // Loop through the sensor types
+  for (i = 0; i < ARRAY_SIZE(types); ++i)
   {
-    // Check if this channel has already been checked
-    if (((data->pwm_channel_checked_field[i / 8] >> (i % 8)) & 0x01) == 1)
+    // Check if this sensor type does not need a refresh
+    if (!test_and_clear_bit(types[i], &data->stale_types))
       continue;
 
-    // Check if this channel does not have the same intial fan PWM as the channel being validated
-    if (initial_fan_pwms[i] != initial_fan_pwms[channel])
-      continue;
+    // Get the transport mutex lock, refresh the cached values that are too old, and release the
+    //   transport mutex lock
+    mutex_lock(&data->transport_mutex);
+    qnap_ec_refresh_cached_values(data, types[i], -1);
+    mutex_unlock(&data->transport_mutex);
+  }
+}
 
+// Function called to invalidate all the cached and snapshot fan PWM values after a fan PWM value
+//   was set
+// Note: all the values are invalidated since setting the fan PWM value of one channel changes the
+//       fan PWM values of all the other channels in the same fan group
+static void qnap_ec_invalidate_cached_pwm_values(struct qnap_ec_data* data)
+{
+  // Declare needed variables
+  uint8_t i;
 
-    // Check if this channel does not have the same changed fan PWM as the channel being validated
-    if (changed_fan_pwms[i] != changed_fan_pwms[channel])
-      continue;
+  // Get the transport mutex lock and the values sequence lock
+  mutex_lock(&data->transport_mutex);
+  write_seqlock(&data->values_lock);
 
-    // Mark this channel as checked
-    data->pwm_channel_checked_field[i / 8] |= (0x01 << (i % 8));
+  // Loop through the cached values and invalidate them and invalidate the snapshot values
+  for (i = 0; i < QNAP_EC_NUMBER_OF_PWM_CHANNELS; ++i)
+    data->pwm_cached_values[i].valid = false;
+  memset(data->snapshot.pwm_valid_field, 0, sizeof(data->snapshot.pwm_valid_field));
 
-    // Check if a valid channel has not yet been marked in this group
-    if (!valid_channel_marked)
-    {
-      // Set the fan speed to an invalid value (to verify that the called function changed the
-      //   value) and call the ec_sys_get_fan_speed function in the libu_Linux_hal library
-      fan_speed = 65535;
-      if (qnap_ec_call_lib_function(false, data, int8_func_uint8_uint32pointer,
-          "ec_sys_get_fan_speed", i, NULL, &fan_speed, NULL, false) != 0)
-        continue;
+  // Release the values sequence lock
+  write_sequnlock(&data->values_lock);
 
-      // Check if the returned fan speed is 65535
-      if (fan_speed == 65535)
-        continue;
+  // Check if background polling is enabled and run the poller right away to get the new fan PWM
+  //   values into the snapshot
+  if (qnap_ec_poll_interval != 0)
+    mod_delayed_work(data->work_queue, &data->poll_work, 0);
 
-      // Mark this channel as valid
-      data->pwm_channel_valid_field[i / 8] |= (0x01 << (i % 8));
+  // Release the transport mutex lock
+  mutex_unlock(&data->transport_mutex);
+}
 
-      // Set the valid channel marked flag
-      valid_channel_marked = true;
-    }
-  }
+// Function called to read a fan speed, fan PWM, or temperature value from the snapshot published
+//   by the poller without taking the transport mutex lock
+// Note: the return value is false if background polling is disabled or if the snapshot does not
+//       contain a value for the channel
+static bool qnap_ec_read_snapshot_value(struct qnap_ec_data* data, enum hwmon_sensor_types type,
+                                        uint8_t channel, long* value)
+{
+  // Declare needed variables
+  unsigned int sequence;
+  bool valid;
+  uint8_t* valid_field;
+  long* values;
 
-  // Release the data mutex lock
-  mutex_unlock(&data->mutex);
-
-  // Check if this channel is invalid
-  if (((data->pwm_channel_valid_field[channel / 8] >> (channel % 8)) & 0x01) == 0)
+  // Check if background polling is disabled
+  if (qnap_ec_poll_interval == 0)
     return false;
 
-  return true;
+  // Switch based on the sensor type and get the snapshot values for the sensor type
+  switch (type)
+  {
+    case hwmon_fan:
+      valid_field = data->snapshot.fan_valid_field;
+      values = data->snapshot.fan_values;
+
+      break;
+    case hwmon_pwm:
+      valid_field = data->snapshot.pwm_valid_field;
+      values = data->snapshot.pwm_values;
+
+      break;
+    case hwmon_temp:
+      valid_field = data->snapshot.temp_valid_field;
+      values = data->snapshot.temp_values;
+
+      break;
+    default:
+      return false;
+  }
+
+  // Get the snapshot value and check if the snapshot contains a value for this channel
+  do
+  {
+    sequence = read_seqbegin(&data->values_lock);
+    valid = ((valid_field[channel / 8] >> (channel % 8)) & 0x01) == 1;
+    *value = values[channel];
+  } while (read_seqretry(&data->values_lock, sequence));
+
+  return valid;
+}
+
+// Function called by the work queue to read all the valid fan speed, fan PWM, and
+//   temperature channels in one batch, publish the values in the snapshot, and reschedule itself
+static void qnap_ec_poll_sensors(struct work_struct* work)
+{
+  // Declare and/or define needed variables
+  uint8_t i;
+  uint8_t channel;
+  int return_value;
+  struct qnap_ec_ioctl_command* command;
+  struct qnap_ec_snapshot* snapshot;
+  struct qnap_ec_data* data = container_of(to_delayed_work(work), struct qnap_ec_data, poll_work);
+
+  // Get the transport mutex lock
+  mutex_lock(&data->transport_mutex);
+
+  // Add calls to the ec_sys_get_fan_speed, ec_sys_get_fan_pwm, and ec_sys_get_temperature
+  //   functions in the libuLinux_hal library for all the valid channels to the batch
+  // Note: the batch is large enough to hold a call for every fan, PWM, and temperature channel
+  data->ioctl_batch.number_of_commands = 0;
+  for (i = 0; i < QNAP_EC_NUMBER_OF_FAN_CHANNELS; ++i)
+    if (test_bit(i, data->fan_channel_valid_field))
+      qnap_ec_queue_lib_function(data, func_ec_sys_get_fan_speed, i, 0, 0, 0);
+  for (i = 0; i < QNAP_EC_NUMBER_OF_PWM_CHANNELS; ++i)
+    if (test_bit(i, data->pwm_channel_valid_field))
+      qnap_ec_queue_lib_function(data, func_ec_sys_get_fan_pwm, i, 0, 0, 0);
+  for (i = 0; i < QNAP_EC_NUMBER_OF_TEMP_CHANNELS; ++i)
+    if (test_bit(i, data->temp_channel_valid_field))
+      qnap_ec_queue_lib_function(data, func_ec_sys_get_temperature, i, 0, 0, 0);
+
+  // Call the functions
+  return_value = qnap_ec_call_lib_functions(data);
+
+  // Get the values sequence lock and empty the snapshot
+  write_seqlock(&data->values_lock);
+  snapshot = &data->snapshot;
+  memset(snapshot->fan_valid_field, 0, sizeof(snapshot->fan_valid_field));
+  memset(snapshot->pwm_valid_field, 0, sizeof(snapshot->pwm_valid_field));
+  memset(snapshot->temp_valid_field, 0, sizeof(snapshot->temp_valid_field));
+
+  // Loop through the commands and save the returned values in the snapshot
+  // Note: if the call failed the snapshot is left empty so that reads fall back to the cache
+  for (i = 0; return_value == 0 && i < data->ioctl_batch.number_of_commands; ++i)
+  {
+    // Check if the function returned an error
+    command = &data->ioctl_batch.commands[i];
+    if (command->return_value_int8 != 0)
+      continue;
+
+    // Switch based on the function and save the returned value for the queued channel
+    // Note: the queued channel is used instead of the channel in the returned command since the
+    //       returned command was copied back from user space
+    channel = data->ioctl_batch_channels[i];
+    switch (command->function)
+    {
+      case func_ec_sys_get_fan_speed:
+        snapshot->fan_values[channel] = command->argument2_uint32;
+        snapshot->fan_valid_field[channel / 8] |= (0x01 << (channel % 8));
+
+        break;
+      case func_ec_sys_get_fan_pwm:
+        snapshot->pwm_values[channel] = command->argument2_uint32;
+        snapshot->pwm_valid_field[channel / 8] |= (0x01 << (channel % 8));
+
+        break;
+      case func_ec_sys_get_temperature:
+        snapshot->temp_values[channel] = command->argument2_int64;
+        snapshot->temp_valid_field[channel / 8] |= (0x01 << (channel % 8));
+
+        break;
+      default:
+        break;
+    }
+  }
+
+  // Release the values sequence lock
+  write_sequnlock(&data->values_lock);
+
+  // Release the transport mutex lock
+  mutex_unlock(&data->transport_mutex);
+
+  // Schedule the next poll
+  queue_delayed_work(data->work_queue, &data->poll_work, msecs_to_jiffies(qnap_ec_poll_interval));
+}
+
+// Function called when the platform device is removed to stop the discovery, unregister the hwmon
+//   device, and stop the background refresh and poller
+// Note: the hwmon device is unregistered before the background refresh and poller are stopped so
+//       that reads can't schedule new background work after it has been cancelled
+static void qnap_ec_remove(void* void_data)
+{
+  // Define needed variables
+  struct qnap_ec_data* data = void_data;
+
+  // Cancel the discovery and wait for it to finish if it's running
+  cancel_work_sync(&data->discovery_work);
+
+  // Check if the hwmon device was registered and unregister it
+  if (data->hwmon_device != NULL)
+    hwmon_device_unregister(data->hwmon_device);
+
+  // Cancel the background refresh and poller work, wait for them to finish if they are running,
+  //   and destroy the work queue
+  cancel_work_sync(&data->refresh_work);
+  cancel_delayed_work_sync(&data->poll_work);
+  destroy_workqueue(data->work_queue);
+}
+
+// Function called to check if the fan channel number is valid
+static bool qnap_ec_is_fan_channel_valid(struct qnap_ec_data* data, uint8_t channel)
+{
+  // Note: based on testing the logic to determining if a fan channel is valid is:
+  //       - call the ec_sys_get_fan_status function in the libuLinux_hal library
+  //       - if the function return value is non zero then the channel is invalid
+  //       - if the returned fan status is non zero then the channel is invalid
+  //       - call the ec_sys_get_fan_speed function in the libuLinux_hal library
+  //       - if the function return value is non zero then the channel is invalid
+  //       - if the returned fan speed is 65535 then the channel is invalid
+  //       - call the ec_sys_get_fan_pwm function in the libuLinux_hal library
+  //       - if the function return value is non zero then the channel is invalid
+  //       - if the returned fan PWM is greater than 255 then the channel is invalid
+  //       - mark the channel as valid
+
+  // Declare needed variables
+  bool valid;
+  struct qnap_ec_ioctl_command* commands = data->ioctl_batch.commands;
+
+  // Check if this channel has already been checked or claim the check of this channel
+  if (!qnap_ec_claim_channel_check(data->fan_channel_checking_field,
+      data->fan_channel_checked_field, data->fan_channel_valid_field, channel, &valid))
+    return valid;
+
+  // Get the transport mutex lock
+  mutex_lock(&data->transport_mutex);
+
+  // Add calls to the ec_sys_get_fan_status, ec_sys_get_fan_speed, and ec_sys_get_fan_pwm functions
+  //   in the libuLinux_hal library to the batch with the fan status, fan speed, and fan PWM set to
+  //   invalid values (to verify that the called functions changed the values) and call them in
+  //   one round trip to the helper program
+  data->ioctl_batch.number_of_commands = 0;
+  qnap_ec_queue_lib_function(data, func_ec_sys_get_fan_status, channel, 0, 1, 0);
+  qnap_ec_queue_lib_function(data, func_ec_sys_get_fan_speed, channel, 0, 65535, 0);
+  qnap_ec_queue_lib_function(data, func_ec_sys_get_fan_pwm, channel, 0, 256, 0);
+
+  // Call the functions and check if any of the functions returned a non zero value, if the
+  //   returned fan status is non zero, if the returned fan speed is 65535, or if the returned fan
+  //   PWM is greater than 255
+  valid = qnap_ec_call_lib_functions(data) == 0 &&
+    commands[0].return_value_int8 == 0 && commands[0].argument2_uint32 == 0 &&
+    commands[1].return_value_int8 == 0 && commands[1].argument2_uint32 != 65535 &&
+    commands[2].return_value_int8 == 0 && commands[2].argument2_uint32 <= 255;
+
+  // Release the transport mutex lock
+  mutex_unlock(&data->transport_mutex);
+
+  // Mark this channel as checked (and valid if it is valid) and release the check of this channel
+  qnap_ec_mark_channel_checked(data->fan_channel_checked_field, data->fan_channel_valid_field,
+    channel, valid);
+  clear_and_wake_up_bit(channel, data->fan_channel_checking_field);
+
+  return valid;
 }
 
-// Function called by the qnap_ec_is_pwm_channel_valid function to read the fan PWMs
-static int qnap_ec_is_pwm_channel_valid_read_fan_pwms(struct qnap_ec_data* data, uint8_t channel,
-                                                      uint8_t initial_fan_pwms[],
-                                                      uint8_t changed_fan_pwms[])
+// Function called to check if the PWM channel number is valid
+static bool qnap_ec_is_pwm_channel_valid(struct qnap_ec_data* data, uint8_t channel)
 {
   // Declare needed variables
+  bool valid;
+
+  // Check if we should not be validating PWM channels and should mimic the fan channels
+  if (!qnap_ec_val_pwm_channels)
+    return qnap_ec_is_fan_channel_valid(data, channel);
+
+  // Check if this channel has already been checked or claim the check of this channel
+  if (!qnap_ec_claim_channel_check(data->pwm_channel_checking_field,
+      data->pwm_channel_checked_field, data->pwm_channel_valid_field, channel, &valid))
+    return valid;
+
+  // Check all the channels that have not been checked yet (which includes this channel unless a
+  //   sweep started by another channel's check already checked it) and release the check of this
+  //   channel
+  mutex_lock(&data->write_mutex);
+  qnap_ec_check_pwm_channels(data);
+  mutex_unlock(&data->write_mutex);
+  clear_and_wake_up_bit(channel, data->pwm_channel_checking_field);
+
+  return test_bit(channel, data->pwm_channel_valid_field);
+}
+
+// Function called to check all the PWM channels that have not been checked yet in one sweep
+// Note: this function must be called with the write mutex locked (so that no fan PWM is set while
+//       the sweep has changed fan PWMs) and gets the transport mutex lock for one batch at a time
+//       so that fan speeds and temperatures can be read between the batches
+static void qnap_ec_check_pwm_channels(struct qnap_ec_data* data)
+{
+  // Note: based on testing channels that share a fan PWM are part of the same group and changing
+  //       the fan PWM of one channel changes the fan PWM of every channel in its group so the
+  //       logic to determine which PWM channels are valid is:
+  //       - read the initial fan PWM of every channel that has not been checked by calling the
+  //         ec_sys_get_fan_pwm function in the libuLinux_hal library
+  //       - if the function return value is non zero for a channel or the returned fan PWM is
+  //         greater than 255 then the channel is invalid
+  //       - in each round pick the lowest numerical channel that has not been checked of each
+  //         initial fan PWM value as the representative of that value (channels with different
+  //         initial fan PWMs can't be in the same group) and increase/decrease the fan PWM of all
+  //         the representatives by calling the ec_sys_set_fan_speed function in the libuLinux_hal
+  //         library
+  //       - if the function return value is non zero for a representative then it is invalid
+  //       - read the changed fan PWM of every channel that has not been checked
+  //       - if the function return value is non zero for a channel or the returned fan PWM is
+  //         greater than 255 then the channel is invalid
+  //       - reset the fan PWM of all the representatives by calling the ec_sys_set_fan_speed
+  //         function in the libuLinux_hal library
+  //       - if the function return value is non zero for a representative then it is invalid
+  //       - if a representative's fan PWM didn't change then it is invalid and otherwise all the
+  //         channels with the same initial fan PWM and changed fan PWM as the representative are
+  //         its group and the lowest numerical channel in the group whose fan speed read by
+  //         calling the ec_sys_get_fan_speed function in the libuLinux_hal library is not 65535
+  //         is valid and the other channels in the group are invalid
+  //       - repeat the rounds until all the channels have been checked
+  //       which changes the fan PWMs at most once per group and only uses a few calls to the
+  //       helper program per round instead of several calls per channel
+  // Note: the channel of every command is taken from the channels recorded when the commands were
+  //       queued instead of from the returned commands (which were copied back from user space)
+  //       since it's used to index the arrays and bitmaps on the stack
+
+  // Declare and/or define needed variables
   uint8_t i;
   uint8_t j;
-  uint32_t fan_pwm;
+  uint8_t channel;
+  unsigned int number_of_rounds = 0;
+  unsigned int number_of_calls = 0;
+  unsigned long start_jiffies = jiffies;
+  uint8_t initial_fan_pwms[QNAP_EC_NUMBER_OF_PWM_CHANNELS];
+  uint8_t changed_fan_pwms[QNAP_EC_NUMBER_OF_PWM_CHANNELS];
+  uint8_t representatives[QNAP_EC_NUMBER_OF_PWM_CHANNELS];
+  DECLARE_BITMAP(checked_field, QNAP_EC_NUMBER_OF_PWM_CHANNELS);
+  DECLARE_BITMAP(valid_field, QNAP_EC_NUMBER_OF_PWM_CHANNELS);
+  DECLARE_BITMAP(changed_field, QNAP_EC_NUMBER_OF_PWM_CHANNELS);
+  DECLARE_BITMAP(group_marked_field, QNAP_EC_NUMBER_OF_PWM_CHANNELS);
+  struct qnap_ec_ioctl_command* commands = data->ioctl_batch.commands;
+
+  // Copy the checked bitmap so that the channels are only marked as checked once the sweep has
+  //   found out which are valid since the checked bitmap is read without getting any lock
+  bitmap_copy(checked_field, data->pwm_channel_checked_field, QNAP_EC_NUMBER_OF_PWM_CHANNELS);
+  bitmap_zero(valid_field, QNAP_EC_NUMBER_OF_PWM_CHANNELS);
+
+  // Get the transport mutex lock, loop through all the channels that have not been checked, and
+  //   add calls to the ec_sys_get_fan_pwm function in the libuLinux_hal library to the batch with
+  //   the fan PWM set to an invalid value (to verify that the called function changed the value)
+  mutex_lock(&data->transport_mutex);
+  data->ioctl_batch.number_of_commands = 0;
+  for (i = 0; i < QNAP_EC_NUMBER_OF_PWM_CHANNELS; ++i)
+    if (!test_bit(i, checked_field))
+      qnap_ec_queue_lib_function(data, func_ec_sys_get_fan_pwm, i, 0, 256, 0);
+  if (data->ioctl_batch.number_of_commands == 0)
+  {
+    // Release the transport mutex lock
+    mutex_unlock(&data->transport_mutex);
+
+    return;
+  }
+
+  // Call the ec_sys_get_fan_pwm functions and mark all the channels as checked (and invalid by
+  //   default) if the calls failed so that no rounds are needed or otherwise loop through the
+  //   commands in the batch and save the initial fan PWMs
+  number_of_calls += data->ioctl_batch.number_of_commands;
+  if (qnap_ec_call_lib_functions(data) != 0)
+    bitmap_fill(checked_field, QNAP_EC_NUMBER_OF_PWM_CHANNELS);
+  else
+    for (i = 0; i < data->ioctl_batch.number_of_commands; ++i)
+    {
+      // Check if the function returned a non zero value or if the returned fan PWM is greater
+      //   than 255 and mark this channel as checked (and invalid by default)
+      channel = data->ioctl_batch_channels[i];
+      if (commands[i].return_value_int8 != 0 || commands[i].argument2_uint32 > 255)
+      {
+        __set_bit(channel, checked_field);
+        continue;
+      }
+
+      initial_fan_pwms[channel] = commands[i].argument2_uint32;
+    }
 
-  // Loop through all the channels starting at the channel being validated
-  for (i = 0, j = channel; i < QNAP_EC_NUMBER_OF_PWM_CHANNELS; ++i, j = (j + 1) %
-       QNAP_EC_NUMBER_OF_PWM_CHANNELS)
+  // Release the transport mutex lock
+  mutex_unlock(&data->transport_mutex);
+
+  // Loop until all the channels have been checked
+  // Note: every round checks at least the representative of every initial fan PWM value
+  for (;;)
   {
-    // Check if this channel has already been checked
-    if (((data->pwm_channel_checked_field[j / 8] >> (j % 8)) & 0x01) == 1)
-      continue;
+    // Get the transport mutex lock, loop through all the channels that have not been checked, find
+    //   the representative of each channel's initial fan PWM value, and add calls to the
+    //   ec_sys_set_fan_speed function in the libuLinux_hal library to increase/decrease the fan
+    //   PWM of each representative to the batch
+    mutex_lock(&data->transport_mutex);
+    data->ioctl_batch.number_of_commands = 0;
+    for (i = 0; i < QNAP_EC_NUMBER_OF_PWM_CHANNELS; ++i)
+    {
+      // Check if this channel has already been checked
+      if (test_bit(i, checked_field))
+        continue;
 
-    // Check if the changed fan PWMs pointer is not NULL (ie: this is the second read) and if
-    //   this channel does not have the same initial fan PWM as the channel being validated
-    if (changed_fan_pwms != NULL && initial_fan_pwms[j] != initial_fan_pwms[channel])
-      continue;
+      // Find the lowest numerical channel that has not been checked with the same initial fan PWM
+      for (j = 0; j < i; ++j)
+        if (!test_bit(j, checked_field) && initial_fan_pwms[j] == initial_fan_pwms[i])
+          break;
+      representatives[i] = j;
 
-    // Set the fan PWM to an invalid value (to verify that the called function changed the value)
-    //   and call the ec_sys_get_fan_pwm function in the libuLinux_hal library
-    fan_pwm = 256;
-    if (qnap_ec_call_lib_function(false, data, int8_func_uint8_uint32pointer, "ec_sys_get_fan_pwm",
-        j, NULL, &fan_pwm, NULL, false) != 0)
+      // Check if this channel is the representative and change its fan PWM
+      if (j == i)
+        qnap_ec_queue_lib_function(data, func_ec_sys_set_fan_speed, i, initial_fan_pwms[i] <=
+          250 ? initial_fan_pwms[i] + 5 : initial_fan_pwms[i] - 5, 0, 0);
+    }
+    if (data->ioctl_batch.number_of_commands == 0)
     {
-      // Check if this is the channel that is being validated and we should return instead of
-      //   continuing in the loop
-      if (j == channel)
-        return -ENODATA;
-
-      // Mark this channel as checked (and invalid by default)
-      data->pwm_channel_checked_field[j / 8] |= (0x01 << (j % 8));
-      
-      continue;
+      // Release the transport mutex lock
+      mutex_unlock(&data->transport_mutex);
+
+      break;
+    }
+    ++number_of_rounds;
+
+    // Call the ec_sys_set_fan_speed functions and mark all the channels as checked (and invalid by
+    //   default) if the calls failed
+    // Note: we try to reset the fan PWMs in case some of the calls succeeded
+    number_of_calls += data->ioctl_batch.number_of_commands;
+    if (qnap_ec_call_lib_functions(data) != 0)
+    {
+      for (i = 0; i < QNAP_EC_NUMBER_OF_PWM_CHANNELS; ++i)
+        if (!test_bit(i, checked_field) && representatives[i] == i)
+          qnap_ec_call_lib_function(false, data, func_ec_sys_set_fan_speed, i,
+            &initial_fan_pwms[i], NULL, NULL, false);
+      bitmap_fill(checked_field, QNAP_EC_NUMBER_OF_PWM_CHANNELS);
+
+      // Release the transport mutex lock
+      mutex_unlock(&data->transport_mutex);
+
+      break;
+    }
+
+    // Loop through the commands in the batch and mark the representatives whose fan PWM couldn't
+    //   be changed as checked (and invalid by default) and the others as changed
+    bitmap_zero(changed_field, QNAP_EC_NUMBER_OF_PWM_CHANNELS);
+    for (i = 0; i < data->ioctl_batch.number_of_commands; ++i)
+    {
+      channel = data->ioctl_batch_channels[i];
+      if (commands[i].return_value_int8 != 0)
+        __set_bit(channel, checked_field);
+      else
+        __set_bit(channel, changed_field);
+    }
+
+    // Release the transport mutex lock
+    mutex_unlock(&data->transport_mutex);
+
+    // Get the transport mutex lock, loop through all the channels that have not been checked and
+    //   whose representative's fan PWM was changed, and add calls to the ec_sys_get_fan_pwm
+    //   function in the libuLinux_hal library to the batch with the fan PWM set to an invalid value
+    //   (to verify that the called function changed the value)
+    mutex_lock(&data->transport_mutex);
+    data->ioctl_batch.number_of_commands = 0;
+    for (i = 0; i < QNAP_EC_NUMBER_OF_PWM_CHANNELS; ++i)
+      if (!test_bit(i, checked_field) && test_bit(representatives[i], changed_field))
+        qnap_ec_queue_lib_function(data, func_ec_sys_get_fan_pwm, i, 0, 256, 0);
+
+    // Call the ec_sys_get_fan_pwm functions and save the changed fan PWMs if the calls succeeded
+    // Note: a channel whose changed fan PWM couldn't be read keeps its initial fan PWM as its
+    //       changed fan PWM so it is never considered part of a changed group
+    for (i = 0; i < QNAP_EC_NUMBER_OF_PWM_CHANNELS; ++i)
+      changed_fan_pwms[i] = initial_fan_pwms[i];
+    number_of_calls += data->ioctl_batch.number_of_commands;
+    if (qnap_ec_call_lib_functions(data) == 0)
+    {
+      for (i = 0; i < data->ioctl_batch.number_of_commands; ++i)
+      {
+        // Check if the function returned a non zero value or if the returned fan PWM is greater
+        //   than 255 and mark this channel as checked (and invalid by default)
+        channel = data->ioctl_batch_channels[i];
+        if (commands[i].return_value_int8 != 0 || commands[i].argument2_uint32 > 255)
+        {
+          __set_bit(channel, checked_field);
+          continue;
+        }
+
+        changed_fan_pwms[channel] = commands[i].argument2_uint32;
+      }
+    }
+
+    // Release the transport mutex lock
+    mutex_unlock(&data->transport_mutex);
+
+    // Get the transport mutex lock, loop through the representatives whose fan PWM was changed,
+    //   and add calls to the ec_sys_set_fan_speed function in the libuLinux_hal library to reset
+    //   their fan PWMs to the batch
+    mutex_lock(&data->transport_mutex);
+    data->ioctl_batch.number_of_commands = 0;
+    for (i = 0; i < QNAP_EC_NUMBER_OF_PWM_CHANNELS; ++i)
+      if (test_bit(i, changed_field))
+        qnap_ec_queue_lib_function(data, func_ec_sys_set_fan_speed, i, initial_fan_pwms[i], 0, 0);
+
+    // Call the ec_sys_set_fan_speed functions and mark the representatives whose fan PWM couldn't
+    //   be reset or didn't actually change as checked (and invalid by default)
+    number_of_calls += data->ioctl_batch.number_of_commands;
+    if (qnap_ec_call_lib_functions(data) != 0)
+      for (i = 0; i < data->ioctl_batch.number_of_commands; ++i)
+        commands[i].return_value_int8 = -1;
+    for (i = 0; i < data->ioctl_batch.number_of_commands; ++i)
+    {
+      channel = data->ioctl_batch_channels[i];
+      if (commands[i].return_value_int8 != 0 ||
+          changed_fan_pwms[channel] == initial_fan_pwms[channel])
+      {
+        __set_bit(channel, checked_field);
+        __clear_bit(channel, changed_field);
+      }
     }
 
-    // Check if the returned fan PWM is greater than 255
-    if (fan_pwm > 255)
+    // Release the transport mutex lock
+    mutex_unlock(&data->transport_mutex);
+
+    // Get the transport mutex lock, loop through all the channels that have not been checked and
+    //   are in the group of a representative whose fan PWM was changed, mark them as checked (and
+    //   invalid by default), and add calls to the ec_sys_get_fan_speed function in the
+    //   libuLinux_hal library to the batch with the fan speed set to an invalid value (to verify
+    //   that the called function changed the value)
+    mutex_lock(&data->transport_mutex);
+    data->ioctl_batch.number_of_commands = 0;
+    for (i = 0; i < QNAP_EC_NUMBER_OF_PWM_CHANNELS; ++i)
+    {
+      j = representatives[i];
+      if (test_bit(i, checked_field) || !test_bit(j, changed_field) ||
+          changed_fan_pwms[i] != changed_fan_pwms[j])
+        continue;
+
+      __set_bit(i, checked_field);
+      qnap_ec_queue_lib_function(data, func_ec_sys_get_fan_speed, i, 0, 65535, 0);
+    }
+
+    // Call the ec_sys_get_fan_speed functions and mark the lowest numerical channel of each group
+    //   whose returned fan speed is not 65535 as valid
+    // Note: the commands are in numerical channel order
+    number_of_calls += data->ioctl_batch.number_of_commands;
+    if (qnap_ec_call_lib_functions(data) != 0)
     {
-      // Check if this is the channel that is being validated and we should return instead of
-      //   continuing in the loop
-      if (j == channel)
-        return -ENODATA;
-
-      // Mark this channel as checked (and invalid by default)
-      data->pwm_channel_checked_field[j / 8] |= (0x01 << (j % 8));
-      
+      // Release the transport mutex lock
+      mutex_unlock(&data->transport_mutex);
+
       continue;
     }
+    bitmap_zero(group_marked_field, QNAP_EC_NUMBER_OF_PWM_CHANNELS);
+    for (i = 0; i < data->ioctl_batch.number_of_commands; ++i)
+    {
+      channel = data->ioctl_batch_channels[i];
+      j = representatives[channel];
+      if (test_bit(j, group_marked_field) || commands[i].return_value_int8 != 0 ||
+          commands[i].argument2_uint32 == 65535)
+        continue;
+
+      __set_bit(channel, valid_field);
+      __set_bit(j, group_marked_field);
+    }
 
-    // Check if the changed fan PWMs pointer is NULL (ie: this is the first read) and use the
-    //   appropriate array for this channel
-    if (changed_fan_pwms == NULL)
-      initial_fan_pwms[j] = fan_pwm;
-    else
-      changed_fan_pwms[j] = fan_pwm;
+    // Release the transport mutex lock
+    mutex_unlock(&data->transport_mutex);
   }
 
-  return 0;
+  // Loop through the channels that were checked by this sweep and mark them as checked (and valid
+  //   if they are valid)
+  for (i = 0; i < QNAP_EC_NUMBER_OF_PWM_CHANNELS; ++i)
+    if (test_bit(i, checked_field) && !test_bit(i, data->pwm_channel_checked_field))
+      qnap_ec_mark_channel_checked(data->pwm_channel_checked_field, data->pwm_channel_valid_field,
+        i, test_bit(i, valid_field));
+
+  // Check if any fan PWMs were changed and invalidate the cached fan PWM values in case any of them
+  //   were read between the batches while they were changed
+  if (number_of_rounds != 0)
+    qnap_ec_invalidate_cached_pwm_values(data);
+
+  pr_info("checked PWM channels in %u ms using %u rounds and %u libuLinux_hal library function "
+    "calls", jiffies_to_msecs(jiffies - start_jiffies), number_of_rounds, number_of_calls);
 }
 
 // Function called to check if the temperature channel number is valid
@@ -987,264 +1996,1481 @@ static bool qnap_ec_is_temp_channel_valid(struct qnap_ec_data* data, uint8_t cha
   //       - mark the channel as valid
 
   // Declare any needed variables
+  bool valid;
   int64_t temperature;
 
-  // Check if this channel has already been checked
-  if (((data->temp_channel_checked_field[channel / 8] >> (channel % 8)) & 0x01) == 1)
-  {
-    // Check if this channel is invalid
-    if (((data->temp_channel_valid_field[channel / 8] >> (channel % 8)) & 0x01) == 0)
-      return false;
-
-    return true;
-  }
+  // Check if this channel has already been checked or claim the check of this channel
+  if (!qnap_ec_claim_channel_check(data->temp_channel_checking_field,
+      data->temp_channel_checked_field, data->temp_channel_valid_field, channel, &valid))
+    return valid;
 
-  // Get the data mutex lock
-  mutex_lock(&data->mutex);
+  // Get the transport mutex lock
+  mutex_lock(&data->transport_mutex);
 
-  // Set the temperature to an invalid value (to verify that the called function changed the value)
-  //   and call the ec_sys_get_temperature function in the libuLinux_hal library
+  // Set the temperature to an invalid value (to verify that the called function changed the value),
+  //   call the ec_sys_get_temperature function in the libuLinux_hal library, and check if the
+  //   function returned a non zero value or if the returned temperature is negative
   temperature = -1;
-  if (qnap_ec_call_lib_function(false, data, int8_func_uint8_doublepointer,
-      "ec_sys_get_temperature", channel, NULL, NULL, &temperature, false) != 0)
-  {
-    // Mark this channel as checked (and invalid by default)
-    data->temp_channel_checked_field[channel / 8] |= (0x01 << (channel % 8));
+  valid = qnap_ec_call_lib_function(false, data, func_ec_sys_get_temperature, channel, NULL, NULL,
+    &temperature, false) == 0 && temperature >= 0;
+
+  // Release the transport mutex lock
+  mutex_unlock(&data->transport_mutex);
+
+  // Mark this channel as checked (and valid if it is valid) and release the check of this channel
+  qnap_ec_mark_channel_checked(data->temp_channel_checked_field, data->temp_channel_valid_field,
+    channel, valid);
+  clear_and_wake_up_bit(channel, data->temp_channel_checking_field);
 
-    // Release the data mutex lock
-    mutex_unlock(&data->mutex);
+  return valid;
+}
 
+// Function called to check if a channel has already been checked without getting any lock and if
+//   so get whether it is valid
+static bool qnap_ec_is_channel_checked(const unsigned long* checked_field,
+                                       const unsigned long* valid_field, uint8_t channel,
+                                       bool* valid)
+{
+  // Check if this channel has not been checked yet
+  if (!test_bit(channel, checked_field))
     return false;
-  }
 
-  // Check if the returned temperature is negative
-  if (temperature < 0)
-  {
-    // Mark this channel as checked (and invalid by default)
-    data->temp_channel_checked_field[channel / 8] |= (0x01 << (channel % 8));
+  // Make sure the valid bit is read after the checked bit (pairs with the barrier in the
+  //   qnap_ec_mark_channel_checked function) and get it
+  smp_rmb();
+  *valid = test_bit(channel, valid_field);
 
-    // Release the data mutex lock
-    mutex_unlock(&data->mutex);
+  return true;
+}
+
+// Function called to mark a channel as checked and if needed as valid
+// Note: the valid bit is set before the checked bit so that a thread that sees the checked bit
+//       without getting any lock also sees the valid bit
+static void qnap_ec_mark_channel_checked(unsigned long* checked_field, unsigned long* valid_field,
+                                         uint8_t channel, bool valid)
+{
+  if (valid)
+    set_bit(channel, valid_field);
+  smp_mb__before_atomic();
+  set_bit(channel, checked_field);
+}
 
+// Function called to claim the check of a channel so that only one thread checks it
+// Note: the return value is false (with the valid argument set) if the channel has already been
+//       checked (possibly by another thread while this thread was waiting for the claim) and is
+//       true if the calling thread has to check the channel and then release the claim by calling
+//       the clear_and_wake_up_bit function for the channel's bit in the checking bitmap
+static bool qnap_ec_claim_channel_check(unsigned long* checking_field,
+                                        const unsigned long* checked_field,
+                                        const unsigned long* valid_field, uint8_t channel,
+                                        bool* valid)
+{
+  // Check if this channel has already been checked
+  if (qnap_ec_is_channel_checked(checked_field, valid_field, channel, valid))
     return false;
-  }
 
-  // Mark this channel as checked and valid
-  data->temp_channel_checked_field[channel / 8] |= (0x01 << (channel % 8));
-  data->temp_channel_valid_field[channel / 8] |= (0x01 << (channel % 8));
+  // Wait until no other thread is checking this channel and claim the check of this channel
+  wait_on_bit_lock(checking_field, channel, TASK_UNINTERRUPTIBLE);
 
-  // Release the data mutex lock
-  mutex_unlock(&data->mutex);
+  // Check if another thread checked this channel while we were waiting and release the claim
+  if (qnap_ec_is_channel_checked(checked_field, valid_field, channel, valid))
+  {
+    clear_and_wake_up_bit(channel, checking_field);
+    return false;
+  }
 
   return true;
 }
 
 // Function called to call a function in the libuLinux_hal library via the user space helper program
-// Note: the return value is the call_usermodehelper function's error code if an error code was
-//       returned or if successful the return value is the user space helper program's error code
-//       if an error code was returned or is the return value is the libuLinux_hal library
-//       function's error code if an error code was return or if successful the return value is zero
+// Note: the return value is the helper program daemon's or the call_usermodehelper function's error
+//       code if an error code was returned or if successful the return value is the user space
+//       helper program's error code if an error code was returned or is the return value is the
+//       libuLinux_hal library function's error code if an error code was return or if successful
+//       the return value is zero
 // Note: we are using an int64 function argument in place of a double since floating point math
 //       (including casting) is not possible in kernel space
 static int qnap_ec_call_lib_function(bool use_mutex, struct qnap_ec_data* data,
-                                     enum qnap_ec_ioctl_function_type function_type,
-                                     char* function_name, uint8_t argument1_uint8,
+                                     enum qnap_ec_ioctl_function function, uint8_t argument1_uint8,
                                      uint8_t* argument2_uint8, uint32_t* argument2_uint32,
                                      int64_t* argument2_int64, bool log_return_error)
 {
-  // Declare and/or define needed variables
-  uint8_t i;
+  // Declare needed variables
   int return_value;
-#ifdef PACKAGE
-  char* paths[] = { "/usr/sbin/qnap-ec", "/usr/bin/qnap-ec", "/sbin/qnap-ec", "/bin/qnap-ec" };
-#else
-  char* paths[] = { "/usr/local/sbin/qnap-ec", "/usr/local/bin/qnap-ec", "/usr/sbin/qnap-ec",
-    "/usr/bin/qnap-ec", "/sbin/qnap-ec", "/bin/qnap-ec" };
-#endif
+  struct qnap_ec_ioctl_command* command;
 
-  // Check if we should use the mutex and get the data mutex lock
+  // Check if we should use the mutex and get the transport mutex lock
   if (use_mutex)
-    mutex_lock(&data->mutex);
+    mutex_lock(&data->transport_mutex);
 
-  // Set the I/O control command structure fields for calling the function in the libuLinux_hal
+  // Set up a batch containing a single command for calling the function in the libuLinux_hal
   //   library via the helper program
-  // Note: "sizeof(((struct qnap_ec_ioctl_command*)0)->function_name)" statement is based on the
-  //       FIELD_SIZEOF macro which was removed from the kernel
-  data->ioctl_command.function_type = function_type;
-  strncpy(data->ioctl_command.function_name, function_name,
-    sizeof(((struct qnap_ec_ioctl_command*)0)->function_name) - 1);
-  data->ioctl_command.argument1_uint8 = argument1_uint8;
-  if (argument2_uint8 != NULL)
-    data->ioctl_command.argument2_uint8 = *argument2_uint8;
-  if (argument2_uint32 != NULL)
-    data->ioctl_command.argument2_uint32 = *argument2_uint32;
-  if (argument2_int64 != NULL)
-    data->ioctl_command.argument2_int64 = *argument2_int64;
-
-  // Set the open device flag to allow return communication by the helper program
-  data->devices->open_misc_device = true;
-
-  // Call the user space helper program and loop through the paths while the first 8 bits of the
-  //   return value contain any error codes
-  i = 0;
-  do
-    return_value = call_usermodehelper(paths[i], (char*[]){ paths[i], NULL }, NULL, UMH_WAIT_PROC);
-  while ((return_value & 0xFF) != 0 && ++i < sizeof(paths) / sizeof(char*));
-
-  // Check if the first 8 bits of the return value contain any error codes
-  if ((return_value & 0xFF) != 0)
-  {
-    // Log the error
-#ifdef PACKAGE
-    pr_err("qnap-ec helper program not found at the expected path (%s) or any of the fall back "
-      "paths (%s, %s, %s)", paths[0], paths[1], paths[2], paths[3]);
-#else
-    pr_err("qnap-ec helper program not found at the expected path (%s) or any of the fall back "
-      "paths (%s, %s, %s, %s, %s)", paths[0], paths[1], paths[2], paths[3], paths[4], paths[5]);
-#endif
-
-    // Clear the open device flag
-    data->devices->open_misc_device = false;
-
-    // Check if we are using the mutex and release the data mutex lock
-    if (use_mutex)
-      mutex_unlock(&data->mutex);
-
-    // Return the call_usermodehelper function's error code
-    return return_value & 0xFF;
-  }
-
-  // Check if the user space helper program's return value stored in the second 8 bits of the
-  //   return value contain any error codes
-  if (((return_value >> 8) & 0xFF) != 0)
+  data->ioctl_batch.number_of_commands = 0;
+  qnap_ec_queue_lib_function(data, function, argument1_uint8,
+    argument2_uint8 != NULL ? *argument2_uint8 : 0, argument2_uint32 != NULL ? *argument2_uint32 : 0,
+    argument2_int64 != NULL ? *argument2_int64 : 0);
+
+  // Call the function
+  return_value = qnap_ec_call_lib_functions(data);
+  if (return_value != 0)
   {
-    // Log the error
-    // Note: the sign (+/-) of the user space helper program's error code is not returned by the
-    //       call_usermodehelper function
-    pr_err("qnap-ec helper program exited with a non zero exit code (+/-%i)",
-      ((return_value >> 8) & 0xFF));
-
-    // Clear the open device flag
-    data->devices->open_misc_device = false;
-
-    // Check if we are using the mutex and release the data mutex lock
+    // Check if we are using the mutex and release the transport mutex lock
     if (use_mutex)
-      mutex_unlock(&data->mutex);
+      mutex_unlock(&data->transport_mutex);
 
-    // Return the user space helper program's error code
-    return (return_value >> 8) & 0xFF;
+    return return_value;
   }
 
-  // Clear the open device flag
-  data->devices->open_misc_device = false;
-
   // Check if the called function returned any errors
-  if (data->ioctl_command.return_value_int8 != 0)
+  command = &data->ioctl_batch.commands[0];
+  if (command->return_value_int8 != 0)
   {
     // Check if we should log the function return error code error and log the error
     if (log_return_error)
       pr_err("libuLinux_hal library %s function called by qnap-ec helper program returned a non "
-        "zero value (%i)", data->ioctl_command.function_name,
-        data->ioctl_command.return_value_int8);
+        "zero value (%i)", qnap_ec_ioctl_function_names[function], command->return_value_int8);
 
-    // Check if we are using the mutex and release the data mutex lock
+    // Check if we are using the mutex and release the transport mutex lock
     if (use_mutex)
-      mutex_unlock(&data->mutex);
+      mutex_unlock(&data->transport_mutex);
 
     // Return the function's error code
-    return data->ioctl_command.return_value_int8;
+    return command->return_value_int8;
   }
 
   // Save any changes to the various arguments
   if (argument2_uint32 != NULL)
-    *argument2_uint32 = data->ioctl_command.argument2_uint32;
+    *argument2_uint32 = command->argument2_uint32;
   if (argument2_int64 != NULL)
-    *argument2_int64 = data->ioctl_command.argument2_int64;
+    *argument2_int64 = command->argument2_int64;
 
-  // Check if we are using the mutex and release the data mutex lock
+  // Check if we are using the mutex and release the transport mutex lock
   if (use_mutex)
-    mutex_unlock(&data->mutex);
+    mutex_unlock(&data->transport_mutex);
 
   return 0;
 }
 
-// Function called when the miscellaneous device is openeded
-static int qnap_ec_misc_device_open(struct inode* inode, struct file* file)
+// Function called to add a call to a function in the libuLinux_hal library to the batch of calls
+//   made by the qnap_ec_call_lib_functions function
+// Note: the transport mutex must be locked when calling this function and the return value is the
+//       index of the command in the batch or -ENOSPC if the batch is full
+static int qnap_ec_queue_lib_function(struct qnap_ec_data* data,
+                                      enum qnap_ec_ioctl_function function,
+                                      uint8_t argument1_uint8, uint8_t argument2_uint8,
+                                      uint32_t argument2_uint32, int64_t argument2_int64)
 {
-  // Declare and/or define needed variables
-  struct qnap_ec_devices* devices = container_of(file->private_data, struct qnap_ec_devices,
-    misc_device);
-
-  // Check if the open device flag is not set which means we are not expecting any communications
-  if (devices->open_misc_device == false)
-    return -EBUSY;
-
-  // Try to lock the miscellaneous device mutex if it's currently unlocked
-  // Note: if the mutex is currently locked it means we are already communicating and this is an
-  //       unexpected communication
-  if (mutex_trylock(&devices->misc_device_mutex) == 0)
-    return -EBUSY;
-
-  return 0;
+  // Declare needed variables
+  struct qnap_ec_ioctl_command* command;
+
+  // Check if the batch is full
+  if (data->ioctl_batch.number_of_commands >= QNAP_EC_IOCTL_BATCH_SIZE)
+    return -ENOSPC;
+
+  // Set the I/O control command structure fields and remember the queued channel
+  data->ioctl_batch_channels[data->ioctl_batch.number_of_commands] = argument1_uint8;
+  command = &data->ioctl_batch.commands[data->ioctl_batch.number_of_commands];
+  command->function = function;
+  command->argument1_uint8 = argument1_uint8;
+  command->argument2_uint8 = argument2_uint8;
+  command->argument2_uint32 = argument2_uint32;
+  command->argument2_int64 = argument2_int64;
+  command->return_value_int8 = 0;
+
+  return data->ioctl_batch.number_of_commands++;
 }
 
-// Function called when the miscellaneous device receives a I/O control command
-static long int qnap_ec_misc_device_ioctl(struct file* file, unsigned int command,
-                                          unsigned long argument)
+// Function called to call all the functions in the libuLinux_hal library that have been added to
+//   the batch with the qnap_ec_queue_lib_function function in one round trip to the helper program
+// Note: the transport mutex must be locked when calling this function and the return value is the
+//       helper program daemon's, the call_usermodehelper function's, or the helper program's error
+//       code if an error code was returned or zero if successful in which case each command's
+//       return value and arguments contain the result of its function
+// Note: a batch that timed out is not passed on to the fallback backend since the embedded
+//       controller chip most likely stopped responding and retrying the batch would only block
+//       the caller for another call timeout
+static int qnap_ec_call_lib_functions(struct qnap_ec_data* data)
 {
-  // Declare and/or define needed variables
-  // Note: the following statement is a combination of the following two statements:
-  //       struct qnap_ec_devices* devices = container_of(file->private_data,
-  //         struct qnap_ec_devices, misc_device);
-  //       struct qnap_ec_data* data = dev_get_drvdata(&devices->plat_device->dev);
-  struct qnap_ec_data* data = dev_get_drvdata(&container_of(file->private_data,
-    struct qnap_ec_devices, misc_device)->plat_device->dev);
-
-  // Swtich based on the command
-  switch (command)
-  {
-    case QNAP_EC_IOCTL_CALL:
-      // Make sure we can write the data to user space
-      if (access_ok(argument, sizeof(struct qnap_ec_ioctl_command)) == 0)
-        return -EFAULT;
+  // Declare needed variables
+  int return_value = 0;
+  const struct qnap_ec_backend* backend;
 
-      // Copy the I/O control command data from the data structure to the user space
-      if (copy_to_user((void*)argument, &data->ioctl_command,
-          sizeof(struct qnap_ec_ioctl_command)) != 0)
-        return -EFAULT;
-  
-      break;
-    case QNAP_EC_IOCTL_RETURN:
-      // Make sure we can read the data from user space
-      if (access_ok(argument, sizeof(struct qnap_ec_ioctl_command)) == 0)
-        return -EFAULT;
-  
-      // Copy the I/O control command data from the user space to the data structure
-      if (copy_from_user(&data->ioctl_command, (void*)argument,
-          sizeof(struct qnap_ec_ioctl_command)) != 0)
-        return -EFAULT;
+  // Check if the batch is empty
+  if (data->ioctl_batch.number_of_commands == 0)
+    return 0;
 
+  // Pass the batch to the selected backend and to its fallback backends until one of them
+  //   successfully processes the batch
+  for (backend = qnap_ec_selected_backend; backend != NULL; backend = backend->fallback)
+  {
+    return_value = backend->call_functions(data);
+    if (return_value != -ENODEV && return_value != -ENOENT && return_value != -EBUSY &&
+        return_value != -EOPNOTSUPP && return_value != -EIO)
       break;
-    default:
-      return -EINVAL;
   }
 
-  return 0;
+  return return_value;
 }
 
-// Function called when the miscellaneous device is released
-static int qnap_ec_misc_device_release(struct inode* inode, struct file* file)
+// Function called by the helper and daemon backends to pass the batch I/O control command to one
+//   of the helper program daemon workers
+// Note: the whole batch is always passed to a single worker (the first attached one) and only one
+//       batch is in flight at a time since every libuLinux_hal library function call is a multi
+//       step exchange on the same E.C. chip ports and two calls running at the same time in
+//       different processes could corrupt each other's results so the other workers are only kept
+//       ready to take over if the first worker exits or is killed
+// Note: a worker that does not return its commands before the call timeout expires is detached and
+//       killed since it's most likely stuck in a library function call waiting for the E.C. chip
+// Note: the transport mutex must be locked when calling this function and the return value is
+//       -ENODEV if no worker is running, -ETIMEDOUT if the worker did not return its commands in
+//       time, or -EIO if the worker exited before returning its commands
+static int qnap_ec_call_helper_daemon(struct qnap_ec_data* data)
 {
   // Declare and/or define needed variables
-  struct qnap_ec_devices* devices = container_of(file->private_data, struct qnap_ec_devices,
-    misc_device);
-
-  // Release the miscellaneous device mutex lock
-  mutex_unlock(&devices->misc_device_mutex);
+  uint8_t i;
+  bool timed_out = false;
+  unsigned int timeout = READ_ONCE(qnap_ec_call_timeout);
+  enum qnap_ec_daemon_command_state state;
+  struct qnap_ec_file_context* worker = NULL;
+  struct qnap_ec_devices* devices = data->devices;
+
+  // Get the daemon lock and get a reference to the first attached worker
+  spin_lock(&devices->daemon_lock);
+  for (i = 0; i < QNAP_EC_MAX_DAEMON_WORKERS && worker == NULL; ++i)
+    worker = devices->daemon_workers[i];
+  if (worker != NULL)
+    kref_get(&worker->refcount);
+  spin_unlock(&devices->daemon_lock);
+
+  // Check if no worker is running
+  if (worker == NULL)
+    return -ENODEV;
+
+  // Copy the batch to the worker's batch
+  // Note: the worker only accesses its batch while it's processing a command so we can fill the
+  //       batch without getting the daemon lock
+  worker->batch.number_of_commands = data->ioctl_batch.number_of_commands;
+  memcpy(worker->batch.commands, data->ioctl_batch.commands,
+    data->ioctl_batch.number_of_commands * sizeof(struct qnap_ec_ioctl_command));
+
+  // Get the daemon lock, mark the worker's command as pending (or as failed if the worker has been
+  //   detached in the meantime), and release the daemon lock
+  spin_lock(&devices->daemon_lock);
+  reinit_completion(&worker->daemon_completion);
+  if (worker->daemon_worker)
+  {
+    worker->daemon_command_state = qnap_ec_daemon_command_pending;
+  }
+  else
+  {
+    worker->daemon_command_state = qnap_ec_daemon_command_failed;
+    complete(&worker->daemon_completion);
+  }
+  spin_unlock(&devices->daemon_lock);
+
+  // Wake up the worker and wait for it to return the commands until the call timeout expires (if
+  //   there is one)
+  wake_up_interruptible(&worker->daemon_wait_queue);
+  if (timeout == 0)
+    wait_for_completion(&worker->daemon_completion);
+  else if (wait_for_completion_timeout(&worker->daemon_completion, msecs_to_jiffies(timeout)) == 0)
+    timed_out = true;
+
+  // Get the daemon lock and check if the worker timed out and still has not returned the commands
+  //   in which case cancel the command and detach the worker so that a late return is rejected
+  spin_lock(&devices->daemon_lock);
+  if (timed_out && (worker->daemon_command_state == qnap_ec_daemon_command_pending ||
+      worker->daemon_command_state == qnap_ec_daemon_command_running))
+    worker->daemon_command_state = qnap_ec_daemon_command_failed;
+  else
+    timed_out = false;
+  if (timed_out)
+    qnap_ec_misc_device_detach_daemon(worker);
+
+  // Get the final command state, mark the worker as idle, and release the daemon lock
+  state = worker->daemon_command_state;
+  worker->daemon_command_state = qnap_ec_daemon_command_idle;
+  spin_unlock(&devices->daemon_lock);
+
+  // Check if the worker timed out, kill it, and record the event
+  if (timed_out)
+  {
+    pr_err("qnap-ec helper program daemon worker did not return its commands within %u "
+      "milliseconds and was killed", timeout);
+    kill_pid(worker->pid, SIGKILL, 1);
+    atomic_long_inc(&data->timed_out_calls);
+    kref_put(&worker->refcount, &qnap_ec_misc_device_free_context);
+
+    return -ETIMEDOUT;
+  }
+
+  // Check if the worker failed to process the commands
+  if (state != qnap_ec_daemon_command_done)
+  {
+    kref_put(&worker->refcount, &qnap_ec_misc_device_free_context);
+
+    return -EIO;
+  }
+
+  // Copy the returned commands back to the batch and release the reference to the worker
+  memcpy(data->ioctl_batch.commands, worker->batch.commands,
+    data->ioctl_batch.number_of_commands * sizeof(struct qnap_ec_ioctl_command));
+  kref_put(&worker->refcount, &qnap_ec_misc_device_free_context);
+
+  return 0;
+}
+
+// Function called by the helper and spawn backends to spawn the user space helper program to
+//   process the batch I/O control command
+// Note: the helper program is killed by the qnap_ec_spawn_helper_program_timeout function if it
+//       does not exit before the call timeout expires in which case the return value is -ETIMEDOUT
+// Note: the transport mutex must be locked when calling this function
+static int qnap_ec_spawn_helper_program(struct qnap_ec_data* data)
+{
+  // Declare and/or define needed variables
+  uint8_t i;
+  int return_value;
+  bool timed_out;
+  char* arguments[2];
+  struct pid* spawn_pid;
+  unsigned int timeout = READ_ONCE(qnap_ec_call_timeout);
+  struct subprocess_info* info;
+  struct qnap_ec_devices* devices = data->devices;
+#ifdef PACKAGE
+  char* paths[] = { "/usr/sbin/qnap-ec", "/usr/bin/qnap-ec", "/sbin/qnap-ec", "/bin/qnap-ec" };
+#else
+  char* paths[] = { "/usr/local/sbin/qnap-ec", "/usr/local/bin/qnap-ec", "/usr/sbin/qnap-ec",
+    "/usr/bin/qnap-ec", "/sbin/qnap-ec", "/bin/qnap-ec" };
+#endif
+
+  // Clear the timed out flag and schedule the timeout work if there is a call timeout
+  spin_lock(&devices->daemon_lock);
+  devices->spawn_timed_out = false;
+  spin_unlock(&devices->daemon_lock);
+  if (timeout != 0)
+    schedule_delayed_work(&devices->spawn_timeout_work, msecs_to_jiffies(timeout));
+
+  // Call the user space helper program and loop through the paths while the first 8 bits of the
+  //   return value contain any error codes and the call timeout has not expired
+  // Note: the qnap_ec_spawn_helper_program_init function remembers the helper program's process ID
+  //       to allow return communication by the helper program and to allow it to be killed
+  i = 0;
+  do
+  {
+    arguments[0] = paths[i];
+    arguments[1] = NULL;
+    info = call_usermodehelper_setup(paths[i], arguments, NULL, GFP_KERNEL,
+      &qnap_ec_spawn_helper_program_init, NULL, devices);
+    if (info == NULL)
+      break;
+    return_value = call_usermodehelper_exec(info, UMH_WAIT_PROC);
+  }
+  while ((return_value & 0xFF) != 0 && !READ_ONCE(devices->spawn_timed_out) &&
+    ++i < sizeof(paths) / sizeof(char*));
+
+  // Cancel the timeout work and forget the helper program's process ID
+  cancel_delayed_work_sync(&devices->spawn_timeout_work);
+  spin_lock(&devices->daemon_lock);
+  spawn_pid = devices->spawn_pid;
+  devices->spawn_pid = NULL;
+  timed_out = devices->spawn_timed_out;
+  spin_unlock(&devices->daemon_lock);
+  put_pid(spawn_pid);
+
+  // Check if the call_usermodehelper_setup function failed
+  if (info == NULL)
+    return -ENOMEM;
+
+  // Check if the helper program was killed because the call timeout expired
+  // Note: a helper program that exited successfully just as the call timeout expired is not treated
+  //       as timed out
+  if (timed_out && return_value != 0)
+  {
+    pr_err("qnap-ec helper program did not exit within %u milliseconds and was killed", timeout);
+    atomic_long_inc(&data->timed_out_calls);
+
+    return -ETIMEDOUT;
+  }
+
+  // Check if the first 8 bits of the return value contain any error codes
+  if ((return_value & 0xFF) != 0)
+  {
+    // Log the error
+#ifdef PACKAGE
+    pr_err("qnap-ec helper program not found at the expected path (%s) or any of the fall back "
+      "paths (%s, %s, %s)", paths[0], paths[1], paths[2], paths[3]);
+#else
+    pr_err("qnap-ec helper program not found at the expected path (%s) or any of the fall back "
+      "paths (%s, %s, %s, %s, %s)", paths[0], paths[1], paths[2], paths[3], paths[4], paths[5]);
+#endif
+
+    // Return the call_usermodehelper function's error code
+    return return_value & 0xFF;
+  }
+
+  // Check if the user space helper program's return value stored in the second 8 bits of the
+  //   return value contain any error codes
+  if (((return_value >> 8) & 0xFF) != 0)
+  {
+    // Log the error
+    // Note: the sign (+/-) of the user space helper program's error code is not returned by the
+    //       call_usermodehelper function
+    pr_err("qnap-ec helper program exited with a non zero exit code (+/-%i)",
+      ((return_value >> 8) & 0xFF));
+
+    // Return the user space helper program's error code
+    return (return_value >> 8) & 0xFF;
+  }
+
+  return 0;
+}
+
+// Function called in the context of the helper program being spawned before it is started to
+//   remember its process ID so that the file it opens can be told apart from other openers' files
+static int qnap_ec_spawn_helper_program_init(struct subprocess_info* info, struct cred* new)
+{
+  // Declare and/or define needed variables
+  struct pid* spawn_pid;
+  struct qnap_ec_devices* devices = info->data;
+
+  // Get the daemon lock and check if the call timeout has already expired in which case the helper
+  //   program is not started
+  spin_lock(&devices->daemon_lock);
+  if (devices->spawn_timed_out)
+  {
+    spin_unlock(&devices->daemon_lock);
+    return -ETIMEDOUT;
+  }
+
+  // Replace the process ID of the previous path's helper program (if any) with this one's and
+  //   release the daemon lock
+  spawn_pid = devices->spawn_pid;
+  devices->spawn_pid = get_pid(task_tgid(current));
+  spin_unlock(&devices->daemon_lock);
+  put_pid(spawn_pid);
+
+  return 0;
+}
+
+// Function called by the spawn timeout work once the call timeout expires to kill the helper
+//   program being spawned
+// Note: if the helper program has not been started yet the timed out flag keeps it from being
+//       started
+static void qnap_ec_spawn_helper_program_timeout(struct work_struct* work)
+{
+  // Declare and/or define needed variables
+  struct qnap_ec_devices* devices = container_of(to_delayed_work(work), struct qnap_ec_devices,
+    spawn_timeout_work);
+
+  // Get the daemon lock, mark the call as timed out, kill the helper program (if it's running), and
+  //   release the daemon lock
+  spin_lock(&devices->daemon_lock);
+  devices->spawn_timed_out = true;
+  if (devices->spawn_pid != NULL)
+    kill_pid(devices->spawn_pid, SIGKILL, 1);
+  spin_unlock(&devices->daemon_lock);
+}
+
+// Function called by the it8528 backend to call the functions in the batch by accessing the IT8528
+//   embedded controller chip directly instead of via the libuLinux_hal library
+// Note: the transport mutex must be locked when calling this function and the return value is
+//       -ENODEV if this isn't a known model, -EBUSY if the ports are in use, -EOPNOTSUPP if the
+//       batch sets a fan PWM and unsafe writes are not allowed, or -EIO if the chip stopped
+//       responding or zero if successful in which case each command's return value and arguments
+//       contain the result of its function just like they would if the function in the
+//       libuLinux_hal library had been called
+static int qnap_ec_it8528_call_functions(struct qnap_ec_data* data)
+{
+  // Declare needed variables
+  uint8_t i;
+  int return_value = 0;
+
+  // Check if this isn't a known model whose channels have been confirmed
+  if (qnap_ec_known_model == NULL)
+    return -ENODEV;
+
+  // Check if unsafe writes are not allowed and the batch sets a fan PWM
+  // Note: the fan PWM register locations have not been confirmed so the batch is passed to the
+  //       fallback backend instead
+  if (!qnap_ec_it8528_unsafe_writes)
+    for (i = 0; i < data->ioctl_batch.number_of_commands; ++i)
+      if (data->ioctl_batch.commands[i].function == func_ec_sys_set_fan_speed)
+        return -EOPNOTSUPP;
+
+  // Request access to the data (0x68) and command (0x6C) ports
+  if (request_muxed_region(QNAP_EC_IT8528_DATA_PORT, 1, "qnap-ec") == NULL)
+    return -EBUSY;
+  if (request_muxed_region(QNAP_EC_IT8528_COMMAND_PORT, 1, "qnap-ec") == NULL)
+  {
+    release_region(QNAP_EC_IT8528_DATA_PORT, 1);
+    return -EBUSY;
+  }
+
+  // Loop through the commands and call each function
+  for (i = 0; i < data->ioctl_batch.number_of_commands; ++i)
+  {
+    return_value = qnap_ec_it8528_call_function(&data->ioctl_batch.commands[i]);
+    if (return_value != 0)
+      break;
+  }
+
+  // Release access to the data and command ports
+  release_region(QNAP_EC_IT8528_COMMAND_PORT, 1);
+  release_region(QNAP_EC_IT8528_DATA_PORT, 1);
+
+  return return_value;
+}
+
+// Function called by the qnap_ec_it8528_call_functions function to do what the function in the
+//   libuLinux_hal library described by the I/O control command does
+// Note: the register addresses are based on the reverse engineering of the libuLinux_hal library
+//       and of the IT8528 firmware used by QNAP and have only been confirmed on a few models, fan
+//       channels 0 through 5 and 6 through 7 each share one PWM register (which matches the fan
+//       PWM groups seen on the TS-673A), temperatures are whole degrees in two's complement
+//       format, and fan PWM values are stored as percentages
+// Note: the command's return value is set to -1 for channels that have no known registers or are
+//       not in the known model's channel maps which is what the libuLinux_hal library functions
+//       return for unknown channels
+static int qnap_ec_it8528_call_function(struct qnap_ec_ioctl_command* command)
+{
+  // Define static constant data consisting of the fan speed register addresses and fan PWM
+  //   register addresses indexed by fan channel
+  static const uint16_t fan_speed_registers[] = { 0x0624, 0x0626, 0x0628, 0x062A, 0x062C, 0x062E,
+    0x0620, 0x0622 };
+  static const uint16_t fan_pwm_registers[] = { 0x022E, 0x022E, 0x022E, 0x022E, 0x022E, 0x022E,
+    0x024B, 0x024B };
+
+  // Declare needed variables
+  int return_value;
+  uint8_t high_byte;
+  uint8_t low_byte;
+  uint8_t channel = command->argument1_uint8;
+  unsigned long long channel_map;
+
+  // Switch based on the function and get the known model's channel map for the function
+  switch (command->function)
+  {
+    case func_ec_sys_get_fan_status:
+    case func_ec_sys_get_fan_speed:
+      channel_map = qnap_ec_known_model->fan_channel_map;
+      break;
+    case func_ec_sys_get_fan_pwm:
+    case func_ec_sys_set_fan_speed:
+      channel_map = qnap_ec_known_model->pwm_channel_map;
+      break;
+    case func_ec_sys_get_temperature:
+      channel_map = qnap_ec_known_model->temp_channel_map;
+      break;
+    default:
+      channel_map = 0;
+      break;
+  }
+
+  // Check if the channel is not in the channel map
+  if (channel >= 64 || ((channel_map >> channel) & 0x01) == 0)
+  {
+    command->return_value_int8 = -1;
+    return 0;
+  }
+
+  // Switch based on the function
+  switch (command->function)
+  {
+    case func_ec_sys_get_fan_status:
+      // Check if this is an unknown fan channel
+      if (channel >= ARRAY_SIZE(fan_speed_registers))
+      {
+        command->return_value_int8 = -1;
+        return 0;
+      }
+
+      // Set the fan status to OK
+      // Note: the fan status register has not been reverse engineered so all the known fan
+      //       channels are reported as OK and the fan speed is relied on to find missing fans
+      command->argument2_uint32 = 0;
+
+      break;
+    case func_ec_sys_get_fan_speed:
+      // Check if this is an unknown fan channel
+      if (channel >= ARRAY_SIZE(fan_speed_registers))
+      {
+        command->return_value_int8 = -1;
+        return 0;
+      }
+
+      // Read the high and low bytes of the fan speed
+      return_value = qnap_ec_it8528_read_register(fan_speed_registers[channel], &high_byte);
+      if (return_value != 0)
+        return return_value;
+      return_value = qnap_ec_it8528_read_register(fan_speed_registers[channel] + 1, &low_byte);
+      if (return_value != 0)
+        return return_value;
+
+      // Set the fan speed
+      command->argument2_uint32 = (high_byte << 8) | low_byte;
+
+      break;
+    case func_ec_sys_get_fan_pwm:
+      // Check if this is an unknown fan channel
+      if (channel >= ARRAY_SIZE(fan_pwm_registers))
+      {
+        command->return_value_int8 = -1;
+        return 0;
+      }
+
+      // Read the fan PWM percentage
+      return_value = qnap_ec_it8528_read_register(fan_pwm_registers[channel], &low_byte);
+      if (return_value != 0)
+        return return_value;
+
+      // Set the fan PWM by converting the percentage to a 0 to 255 value
+      command->argument2_uint32 = (low_byte * 255 + 50) / 100;
+
+      break;
+    case func_ec_sys_get_temperature:
+      // Check if this is an unknown temperature channel
+      if (channel >= 16)
+      {
+        command->return_value_int8 = -1;
+        return 0;
+      }
+
+      // Read the temperature
+      return_value = qnap_ec_it8528_read_register(0x0600 + channel, &low_byte);
+      if (return_value != 0)
+        return return_value;
+
+      // Set the temperature in the same format the helper program uses which is the temperature
+      //   multiplied by 1000
+      command->argument2_int64 = (int64_t)(int8_t)low_byte * 1000;
+
+      break;
+    case func_ec_sys_set_fan_speed:
+      // Check if this is an unknown fan channel
+      if (channel >= ARRAY_SIZE(fan_pwm_registers))
+      {
+        command->return_value_int8 = -1;
+        return 0;
+      }
+
+      // Write the fan PWM by converting the 0 to 255 value to a percentage
+      return_value = qnap_ec_it8528_write_register(fan_pwm_registers[channel],
+        (command->argument2_uint8 * 100 + 127) / 255);
+      if (return_value != 0)
+        return return_value;
+
+      break;
+    default:
+      command->return_value_int8 = -1;
+      return 0;
+  }
+
+  // Set the return value to success
+  command->return_value_int8 = 0;
+
+  return 0;
+}
+
+// Function called to read a register of the IT8528 embedded controller chip
+// Note: the data and command ports must have been requested when calling this function
+static int qnap_ec_it8528_read_register(uint16_t address, uint8_t* value)
+{
+  // Declare needed variables
+  int return_value;
+
+  // Write the access command to the command port followed by the high and low bytes of the
+  //   address to the data port making sure the chip has read each byte before writing the next one
+  return_value = qnap_ec_it8528_wait_for_status(QNAP_EC_IT8528_INPUT_BUFFER_FULL, false);
+  if (return_value != 0)
+    return return_value;
+  outb(QNAP_EC_IT8528_ACCESS_COMMAND, QNAP_EC_IT8528_COMMAND_PORT);
+  return_value = qnap_ec_it8528_wait_for_status(QNAP_EC_IT8528_INPUT_BUFFER_FULL, false);
+  if (return_value != 0)
+    return return_value;
+  outb(address >> 8, QNAP_EC_IT8528_DATA_PORT);
+  return_value = qnap_ec_it8528_wait_for_status(QNAP_EC_IT8528_INPUT_BUFFER_FULL, false);
+  if (return_value != 0)
+    return return_value;
+  outb(address & 0xFF, QNAP_EC_IT8528_DATA_PORT);
+
+  // Wait for the chip to place the value in the output buffer and read it from the data port
+  return_value = qnap_ec_it8528_wait_for_status(QNAP_EC_IT8528_OUTPUT_BUFFER_FULL, true);
+  if (return_value != 0)
+    return return_value;
+  *value = inb(QNAP_EC_IT8528_DATA_PORT);
+
+  return 0;
+}
+
+// Function called to write to a register of the IT8528 embedded controller chip
+// Note: the data and command ports must have been requested when calling this function and writes
+//       are distinguished from reads by setting the highest bit of the address's high byte
+static int qnap_ec_it8528_write_register(uint16_t address, uint8_t value)
+{
+  // Declare needed variables
+  int return_value;
+
+  // Write the access command to the command port followed by the high and low bytes of the
+  //   address and the value to the data port making sure the chip has read each byte before
+  //   writing the next one
+  return_value = qnap_ec_it8528_wait_for_status(QNAP_EC_IT8528_INPUT_BUFFER_FULL, false);
+  if (return_value != 0)
+    return return_value;
+  outb(QNAP_EC_IT8528_ACCESS_COMMAND, QNAP_EC_IT8528_COMMAND_PORT);
+  return_value = qnap_ec_it8528_wait_for_status(QNAP_EC_IT8528_INPUT_BUFFER_FULL, false);
+  if (return_value != 0)
+    return return_value;
+  outb((address >> 8) | 0x80, QNAP_EC_IT8528_DATA_PORT);
+  return_value = qnap_ec_it8528_wait_for_status(QNAP_EC_IT8528_INPUT_BUFFER_FULL, false);
+  if (return_value != 0)
+    return return_value;
+  outb(address & 0xFF, QNAP_EC_IT8528_DATA_PORT);
+  return_value = qnap_ec_it8528_wait_for_status(QNAP_EC_IT8528_INPUT_BUFFER_FULL, false);
+  if (return_value != 0)
+    return return_value;
+  outb(value, QNAP_EC_IT8528_DATA_PORT);
+
+  return 0;
+}
+
+// Function called to wait for a bit in the IT8528 embedded controller chip's status register to be
+//   set or cleared
+// Note: the return value is -EIO if the bit did not change within roughly 10 milliseconds
+// Note: this function sleeps between checks instead of busy waiting since it's called with the
+//       transport mutex locked and a slow chip would otherwise tie up the CPU for every byte
+static int qnap_ec_it8528_wait_for_status(uint8_t bit, bool set)
+{
+  // Declare and/or define needed variables
+  unsigned long timeout = jiffies + msecs_to_jiffies(10);
+
+  // Loop until the bit has the requested state or we run out of time
+  for (;;)
+  {
+    // Check if the bit has the requested state
+    if (((inb(QNAP_EC_IT8528_COMMAND_PORT) & bit) != 0) == set)
+      return 0;
+
+    // Check if we ran out of time
+    if (time_after(jiffies, timeout))
+      break;
+
+    // Wait before checking again
+    usleep_range(10, 20);
+  }
+
+  // Log the error
+  pr_err("IT8528 embedded controller chip did not respond");
+
+  return -EIO;
+}
+
+// Function called by the sim backend to call the functions in the batch by simulating the
+//   functions in the libuLinux_hal library without leaving kernel space
+// Note: the transport mutex must be locked when calling this function
+static int qnap_ec_sim_call_functions(struct qnap_ec_data* data)
+{
+  // Declare needed variables
+  uint8_t i;
+
+  // Loop through the commands and simulate each function
+  for (i = 0; i < data->ioctl_batch.number_of_commands; ++i)
+    qnap_ec_sim_call_function(&data->ioctl_batch.commands[i]);
+
+  return 0;
+}
+
+// Function called by the qnap_ec_sim_call_functions function to simulate the function in the
+//   libuLinux_hal library described by the I/O control command
+// Note: this simulation returns the static values recorded during a sweep of all the channels on a
+//       TS-673A unit (the same values as the simulated libuLinux_hal library's built in TS-673A
+//       profile) and does not model the fan speeds and temperatures like the simulated library
+//       does except that setting a fan PWM value changes the fan PWM values of all the fan
+//       channels in the same fan PWM group so that the PWM channel validation finds the same PWM
+//       channels it would find on real hardware
+static void qnap_ec_sim_call_function(struct qnap_ec_ioctl_command* command)
+{
+  // Declare needed variables
+  int8_t group;
+  uint8_t channel = command->argument1_uint8;
+
+  // Get the fan PWM group of the channel
+  switch (channel)
+  {
+    case 0 ... 5:
+      group = 0;
+      break;
+    case 6 ... 7:
+      group = 1;
+      break;
+    case 20 ... 25:
+      group = 2;
+      break;
+    case 30 ... 35:
+      group = 3;
+      break;
+    default:
+      group = -1;
+      break;
+  }
+
+  // Set the return value to success by default
+  command->return_value_int8 = 0;
+
+  // Switch based on the function
+  switch (command->function)
+  {
+    case func_ec_sys_get_fan_status:
+      // Switch based on the channel and set the fan status
+      switch (channel)
+      {
+        case 0 ... 1:
+        case 6:
+        case 10 ... 11:
+        case 20 ... 25:
+        case 30 ... 35:
+          command->argument2_uint32 = 0;
+          break;
+        case 2 ... 5:
+        case 7:
+          command->argument2_uint32 = 1;
+          break;
+        default:
+          command->argument2_uint32 = 0;
+          command->return_value_int8 = -1;
+          break;
+      }
+
+      break;
+    case func_ec_sys_get_fan_speed:
+      // Switch based on the channel and set the fan speed
+      switch (channel)
+      {
+        case 0 ... 1:
+          command->argument2_uint32 = 650 + get_random_u32() % 11;
+          break;
+        case 6:
+          command->argument2_uint32 = 890 + get_random_u32() % 11;
+          break;
+        case 10 ... 11:
+          command->argument2_uint32 = (uint32_t)-2;
+          break;
+        case 33:
+          command->argument2_uint32 = 4976;
+          break;
+        case 34:
+          command->argument2_uint32 = 12096;
+          break;
+        case 2 ... 5:
+        case 7:
+        case 20 ... 25:
+        case 30 ... 32:
+        case 35:
+          command->argument2_uint32 = 65535;
+          break;
+        default:
+          command->argument2_uint32 = 0;
+          command->return_value_int8 = -1;
+          break;
+      }
+
+      break;
+    case func_ec_sys_get_fan_pwm:
+      // Check if the channel is not part of a fan PWM group
+      if (group < 0)
+      {
+        command->argument2_uint32 = 0;
+        command->return_value_int8 = -1;
+        break;
+      }
+
+      // Set the fan PWM to the fan PWM group's value
+      command->argument2_uint32 = qnap_ec_sim_pwm_values[group];
+
+      break;
+    case func_ec_sys_get_temperature:
+      // Switch based on the channel and set the temperature multiplied by 1000 (see the notes in
+      //   the helper program)
+      switch (channel)
+      {
+        case 0:
+        case 7:
+          command->argument2_int64 = (28 + get_random_u32() % 3) * 1000;
+          break;
+        case 5 ... 6:
+          command->argument2_int64 = (23 + get_random_u32() % 3) * 1000;
+          break;
+        case 10 ... 11:
+          command->argument2_int64 = -2000;
+          break;
+        case 15:
+          command->argument2_int64 = -128000;
+          break;
+        case 1:
+        case 16 ... 38:
+          command->argument2_int64 = -1000;
+          break;
+        default:
+          command->argument2_int64 = 0;
+          command->return_value_int8 = -1;
+          break;
+      }
+
+      break;
+    case func_ec_sys_set_fan_speed:
+      // Check if the channel is not part of a fan PWM group
+      if (group < 0)
+      {
+        command->return_value_int8 = -1;
+        break;
+      }
+
+      // Set the fan PWM group's value
+      qnap_ec_sim_pwm_values[group] = command->argument2_uint8;
+
+      break;
+    default:
+      command->return_value_int8 = -1;
+      break;
+  }
+}
+
+// Function called when the miscellaneous device is openeded
+static int qnap_ec_misc_device_open(struct inode* inode, struct file* file)
+{
+  // Declare and/or define needed variables
+  struct qnap_ec_file_context* context;
+  struct qnap_ec_devices* devices = container_of(file->private_data, struct qnap_ec_devices,
+    misc_device);
+
+  // Allocate memory for this file's context
+  context = kzalloc(sizeof(struct qnap_ec_file_context), GFP_KERNEL);
+  if (context == NULL)
+    return -ENOMEM;
+  context->devices = devices;
+  kref_init(&context->refcount);
+  context->pid = get_pid(task_tgid(current));
+  mutex_init(&context->mutex);
+  init_waitqueue_head(&context->daemon_wait_queue);
+  init_completion(&context->daemon_completion);
+
+  // Check if the helper program the kernel module is spawning is opening the device
+  // Note: only that file is allowed to use the commands used by the spawned helper program so that
+  //       other openers can never take or return the kernel module's batch
+  spin_lock(&devices->daemon_lock);
+  context->spawned = (devices->spawn_pid != NULL && devices->spawn_pid == task_tgid(current));
+  spin_unlock(&devices->daemon_lock);
+
+  // Replace the miscellaneous device pointer in the file's private data with the context
+  file->private_data = context;
+
+  return 0;
+}
+
+// Function called when the miscellaneous device receives a I/O control command
+static long int qnap_ec_misc_device_ioctl(struct file* file, unsigned int command,
+                                          unsigned long argument)
+{
+  // Declare and/or define needed variables
+  bool is_daemon;
+  int return_value;
+  struct qnap_ec_ioctl_hello hello;
+  struct qnap_ec_file_context* context = file->private_data;
+  struct qnap_ec_devices* devices = context->devices;
+  struct qnap_ec_data* data = dev_get_drvdata(&devices->plat_device->dev);
+
+  // Check if the platform device has not been probed yet
+  if (data == NULL)
+    return -ENODEV;
+
+  // Check if this is the handshake command
+  if (command == QNAP_EC_IOCTL_HELLO)
+  {
+    // Copy the handshake data from the user space
+    if (copy_from_user(&hello, (void __user*)argument, sizeof(struct qnap_ec_ioctl_hello)) != 0)
+      return -EFAULT;
+
+    // Check if the helper program was built with a different I/O control interface version
+    if (hello.version != QNAP_EC_IOCTL_VERSION)
+    {
+      pr_err("qnap-ec helper program uses I/O control interface version %u instead of version %u",
+        hello.version, QNAP_EC_IOCTL_VERSION);
+      return -EPROTO;
+    }
+
+    // Copy the handshake data to the user space and mark the handshake as done
+    hello.number_of_functions = number_of_funcs;
+    if (copy_to_user((void __user*)argument, &hello, sizeof(struct qnap_ec_ioctl_hello)) != 0)
+      return -EFAULT;
+    context->handshake_done = true;
+
+    return 0;
+  }
+
+  // Check if the handshake has not been done
+  if (!context->handshake_done)
+    return -EPROTO;
+
+  // Check if this file is attached as a helper program daemon worker
+  spin_lock(&devices->daemon_lock);
+  is_daemon = context->daemon_worker;
+  spin_unlock(&devices->daemon_lock);
+
+  // Swtich based on the command
+  switch (command)
+  {
+    case QNAP_EC_IOCTL_BATCH_CALL:
+      // Check if this file was not opened by a spawned helper program
+      if (!context->spawned)
+        return -EBUSY;
+
+      // Copy the I/O control command data from the data structure to the user space
+      return qnap_ec_misc_device_copy_batch(&data->ioctl_batch, argument, true);
+    case QNAP_EC_IOCTL_BATCH_RETURN:
+      // Check if this is the helper program daemon and it's not processing a command or if this is
+      //   not the daemon and this file was not opened by a spawned helper program
+      if ((is_daemon && READ_ONCE(context->daemon_command_state) !=
+          qnap_ec_daemon_command_running) || (!is_daemon && !context->spawned))
+        return -EBUSY;
+
+      // Copy the I/O control command data from the user space to the worker's batch if this is a
+      //   helper program daemon worker and mark the command as done or failed and wake up the
+      //   caller or otherwise to the data structure
+      if (is_daemon)
+      {
+        return_value = qnap_ec_misc_device_copy_batch(&context->batch, argument, false);
+        qnap_ec_misc_device_complete_daemon_command(context, return_value == 0 ?
+          qnap_ec_daemon_command_done : qnap_ec_daemon_command_failed);
+      }
+      else
+      {
+        return_value = qnap_ec_misc_device_copy_batch(&data->ioctl_batch, argument, false);
+      }
+
+      return return_value;
+    case QNAP_EC_IOCTL_BATCH_WAIT:
+      // Attach this file as a helper program daemon worker and wait for a command
+      return_value = qnap_ec_misc_device_attach_daemon(context);
+      if (return_value != 0)
+        return return_value;
+      return_value = qnap_ec_misc_device_wait_for_daemon_command(context);
+      if (return_value != 0)
+        return return_value;
+
+      // Copy the I/O control command data from the worker's batch to the user space
+      // Note: the dispatcher only changes the worker's batch while the worker is idle so the
+      //       command data will not change
+      return_value = qnap_ec_misc_device_copy_batch(&context->batch, argument, true);
+      if (return_value != 0)
+        qnap_ec_misc_device_complete_daemon_command(context, qnap_ec_daemon_command_failed);
+
+      return return_value;
+    case QNAP_EC_IOCTL_RING_ENTER:
+      // Check if the shared memory command ring has not been mapped
+      if (smp_load_acquire(&context->ring) == NULL)
+        return -EINVAL;
+
+      // Attach this file as a helper program daemon worker and complete the previous command and
+      //   wait for the next command using the shared memory command ring
+      return_value = qnap_ec_misc_device_attach_daemon(context);
+      if (return_value != 0)
+        return return_value;
+
+      return qnap_ec_misc_device_ring_enter(context);
+    case QNAP_EC_IOCTL_QUERY:
+      // Check if this is the helper program daemon or a spawned helper program which would end up
+      //   waiting for itself
+      if (is_daemon || context->spawned)
+        return -EDEADLK;
+
+      // Call the functions in the batch on behalf of this file
+      return qnap_ec_misc_device_query(context, data, argument);
+    default:
+      return -EINVAL;
+  }
+}
+
+// Function called by the qnap_ec_misc_device_ioctl function to copy the batch I/O control command
+//   data to or from user space
+// Note: when copying from user space the number of commands in the batch is never changed
+static int qnap_ec_misc_device_copy_batch(struct qnap_ec_ioctl_batch_command* ioctl_batch,
+                                          unsigned long argument, bool to_user)
+{
+  // Declare and/or define needed variables
+  uint16_t i;
+  struct qnap_ec_ioctl_command returned_command;
+  unsigned long size = ioctl_batch->number_of_commands * sizeof(struct qnap_ec_ioctl_command);
+  struct qnap_ec_ioctl_batch_command __user* user_batch = (void __user*)argument;
+  struct qnap_ec_ioctl_command __user* user_commands = user_batch->commands;
+
+  // Check if we are copying to user space
+  if (to_user)
+  {
+    // Make sure we can write the data to user space
+    if (access_ok(argument, sizeof(struct qnap_ec_ioctl_batch_command)) == 0)
+      return -EFAULT;
+
+    // Copy the number of commands and the commands from the batch to the user space
+    if (copy_to_user(&user_batch->number_of_commands, &ioctl_batch->number_of_commands,
+        sizeof(ioctl_batch->number_of_commands)) != 0)
+      return -EFAULT;
+    if (copy_to_user(user_commands, ioctl_batch->commands, size) != 0)
+      return -EFAULT;
+  }
+  else
+  {
+    // Make sure we can read the data from user space
+    if (access_ok(argument, sizeof(struct qnap_ec_ioctl_batch_command)) == 0)
+      return -EFAULT;
+
+    // Loop through the commands, copy each command from the user space, and return its results
+    //   to the batch
+    // Note: the commands are copied one at a time so that only the results and not the function or
+    //       channel of the queued commands can be changed from user space
+    for (i = 0; i < ioctl_batch->number_of_commands; ++i)
+    {
+      if (copy_from_user(&returned_command, &user_commands[i], sizeof(returned_command)) != 0)
+        return -EFAULT;
+      if (qnap_ec_misc_device_return_command(&ioctl_batch->commands[i], &returned_command) != 0)
+        return -EINVAL;
+    }
+  }
+
+  return 0;
+}
+
+// Function called to copy the results of a command returned by the helper program into the queued
+//   command
+// Note: only the return value and the second arguments are copied and the return value is -EINVAL
+//       if the returned command's function or channel is different from the queued command's
+static int qnap_ec_misc_device_return_command(struct qnap_ec_ioctl_command* command,
+                                              const struct qnap_ec_ioctl_command* returned_command)
+{
+  // Check if the function or the channel was changed
+  if (returned_command->function != command->function ||
+      returned_command->argument1_uint8 != command->argument1_uint8)
+    return -EINVAL;
+
+  // Copy the results
+  command->return_value_int8 = returned_command->return_value_int8;
+  command->argument2_uint8 = returned_command->argument2_uint8;
+  command->argument2_uint32 = returned_command->argument2_uint32;
+  command->argument2_int64 = returned_command->argument2_int64;
 
   return 0;
 }
 
+// Function called by the qnap_ec_misc_device_ioctl function to call the functions in a batch I/O
+//   control command passed in by a user space client and copy the results back to user space
+// Note: the batch is copied into the file's own context first so that the transport mutex is only
+//       held while the commands are being called and the return value is -EPERM if the batch
+//       contains a function other than the functions that get a fan status, fan speed, fan PWM, or
+//       temperature or is -EIO if the backends returned a positive error code
+static int qnap_ec_misc_device_query(struct qnap_ec_file_context* context,
+                                     struct qnap_ec_data* data, unsigned long argument)
+{
+  // Declare and/or define needed variables
+  uint16_t i;
+  int return_value;
+  struct qnap_ec_ioctl_batch_command* batch = &context->batch;
+  struct qnap_ec_ioctl_batch_command __user* user_batch = (void __user*)argument;
+
+  // Get the context mutex lock
+  mutex_lock(&context->mutex);
+
+  // Copy the number of commands and the commands from the user space to the context and check if
+  //   the number of commands is invalid or if any of the functions are not allowed
+  return_value = 0;
+  if (copy_from_user(&batch->number_of_commands, &user_batch->number_of_commands,
+      sizeof(batch->number_of_commands)) != 0)
+    return_value = -EFAULT;
+  else if (batch->number_of_commands == 0 || batch->number_of_commands > QNAP_EC_IOCTL_BATCH_SIZE)
+    return_value = -EINVAL;
+  else if (copy_from_user(batch->commands, user_batch->commands, batch->number_of_commands *
+           sizeof(struct qnap_ec_ioctl_command)) != 0)
+    return_value = -EFAULT;
+  for (i = 0; return_value == 0 && i < batch->number_of_commands; ++i)
+    if (batch->commands[i].function != func_ec_sys_get_fan_status &&
+        batch->commands[i].function != func_ec_sys_get_fan_speed &&
+        batch->commands[i].function != func_ec_sys_get_fan_pwm &&
+        batch->commands[i].function != func_ec_sys_get_temperature)
+      return_value = -EPERM;
+  if (return_value != 0)
+  {
+    // Release the context mutex lock
+    mutex_unlock(&context->mutex);
+
+    return return_value;
+  }
+
+  // Get the transport mutex lock, add the calls to the batch, call the functions, and copy the
+  //   results to the context if the calls succeeded
+  mutex_lock(&data->transport_mutex);
+  data->ioctl_batch.number_of_commands = 0;
+  for (i = 0; i < batch->number_of_commands; ++i)
+    qnap_ec_queue_lib_function(data, batch->commands[i].function,
+      batch->commands[i].argument1_uint8, batch->commands[i].argument2_uint8,
+      batch->commands[i].argument2_uint32, batch->commands[i].argument2_int64);
+  return_value = qnap_ec_call_lib_functions(data);
+  if (return_value == 0)
+    memcpy(batch->commands, data->ioctl_batch.commands, batch->number_of_commands *
+      sizeof(struct qnap_ec_ioctl_command));
+  mutex_unlock(&data->transport_mutex);
+
+  // Copy the results from the context to the user space if the calls succeeded
+  if (return_value > 0)
+    return_value = -EIO;
+  else if (return_value == 0 && copy_to_user(user_batch->commands, batch->commands,
+           batch->number_of_commands * sizeof(struct qnap_ec_ioctl_command)) != 0)
+    return_value = -EFAULT;
+
+  // Release the context mutex lock
+  mutex_unlock(&context->mutex);
+
+  return return_value;
+}
+
+// Function called by the qnap_ec_misc_device_ioctl function to complete the previous command in the
+//   shared memory command ring and submit the next command to the ring
+// Note: the ring is only accessed by this function which runs in the context of the helper program
+//       daemon worker so the ring memory can not be freed while it's being accessed
+static int qnap_ec_misc_device_ring_enter(struct qnap_ec_file_context* context)
+{
+  // Declare and/or define needed variables
+  uint16_t i;
+  int return_value;
+  enum qnap_ec_daemon_command_state state;
+  struct qnap_ec_ioctl_command returned_command;
+  struct qnap_ec_ring* ring = smp_load_acquire(&context->ring);
+  uint16_t number_of_commands = context->batch.number_of_commands;
+  uint32_t start = context->ring_tail - number_of_commands;
+
+  // Check if the worker is returning a command
+  if (READ_ONCE(context->daemon_command_state) == qnap_ec_daemon_command_running)
+  {
+    // Check if the worker did not complete all the commands in the ring
+    state = qnap_ec_daemon_command_failed;
+    if (smp_load_acquire(&ring->completion_tail) == context->ring_tail)
+    {
+      // Loop through the completed commands, copy each command out of the ring, and return its
+      //   results to the worker's batch
+      // Note: each slot is copied before being checked since the ring is shared with user space
+      state = qnap_ec_daemon_command_done;
+      for (i = 0; i < number_of_commands; ++i)
+      {
+        returned_command = ring->slots[(start + i) % QNAP_EC_RING_SIZE];
+        if (qnap_ec_misc_device_return_command(&context->batch.commands[i], &returned_command) !=
+            0)
+        {
+          state = qnap_ec_daemon_command_failed;
+          break;
+        }
+      }
+    }
+
+    // Mark the command as done or failed
+    qnap_ec_misc_device_complete_daemon_command(context, state);
+  }
+
+  // Wait for the next command
+  return_value = qnap_ec_misc_device_wait_for_daemon_command(context);
+  if (return_value != 0)
+    return return_value;
+
+  // Copy the commands from the worker's batch to the ring and advance the submission tail
+  // Note: the dispatcher only changes the worker's batch while the worker is idle so the command
+  //       data will not change
+  start = context->ring_tail;
+  number_of_commands = context->batch.number_of_commands;
+  for (i = 0; i < number_of_commands; ++i)
+    ring->slots[(start + i) % QNAP_EC_RING_SIZE] = context->batch.commands[i];
+  context->ring_tail = start + number_of_commands;
+  smp_store_release(&ring->submission_tail, context->ring_tail);
+
+  return 0;
+}
+
+// Function called by the qnap_ec_misc_device_ioctl function to attach a file as a helper program
+//   daemon worker
+// Note: the return value is -EBUSY if the maximum number of workers is already attached
+static int qnap_ec_misc_device_attach_daemon(struct qnap_ec_file_context* context)
+{
+  // Declare and/or define needed variables
+  uint8_t i;
+  struct qnap_ec_devices* devices = context->devices;
+
+  // Get the daemon lock and check if this file is already attached
+  spin_lock(&devices->daemon_lock);
+  if (context->daemon_worker)
+  {
+    spin_unlock(&devices->daemon_lock);
+    return 0;
+  }
+
+  // Loop through the worker slots and attach this file to the first free slot
+  for (i = 0; i < QNAP_EC_MAX_DAEMON_WORKERS; ++i)
+  {
+    if (devices->daemon_workers[i] == NULL)
+    {
+      devices->daemon_workers[i] = context;
+      context->daemon_worker = true;
+      spin_unlock(&devices->daemon_lock);
+
+      return 0;
+    }
+  }
+  spin_unlock(&devices->daemon_lock);
+
+  return -EBUSY;
+}
+
+// Function called to detach a file from the helper program daemon worker slots
+// Note: the daemon lock must be locked when calling this function and the return value is true if
+//       the file was attached
+static bool qnap_ec_misc_device_detach_daemon(struct qnap_ec_file_context* context)
+{
+  // Declare and/or define needed variables
+  uint8_t i;
+  struct qnap_ec_devices* devices = context->devices;
+
+  // Check if this file is not attached
+  if (!context->daemon_worker)
+    return false;
+
+  // Loop through the worker slots and clear this file's slot
+  for (i = 0; i < QNAP_EC_MAX_DAEMON_WORKERS; ++i)
+    if (devices->daemon_workers[i] == context)
+      devices->daemon_workers[i] = NULL;
+  context->daemon_worker = false;
+
+  return true;
+}
+
+// Function called by the qnap_ec_misc_device_ioctl function to wait for a command to be pending
+//   for a helper program daemon worker and mark it as running
+static int qnap_ec_misc_device_wait_for_daemon_command(struct qnap_ec_file_context* context)
+{
+  // Declare and/or define needed variables
+  struct qnap_ec_devices* devices = context->devices;
+
+  // Loop until we get a pending command
+  // Note: the command may have been taken by another waiting thread in the worker between being
+  //       woken up and getting the daemon lock so we need to loop
+  for (;;)
+  {
+    if (wait_event_interruptible(context->daemon_wait_queue,
+        READ_ONCE(context->daemon_command_state) == qnap_ec_daemon_command_pending) != 0)
+      return -ERESTARTSYS;
+
+    spin_lock(&devices->daemon_lock);
+    if (context->daemon_command_state == qnap_ec_daemon_command_pending)
+    {
+      context->daemon_command_state = qnap_ec_daemon_command_running;
+      spin_unlock(&devices->daemon_lock);
+
+      return 0;
+    }
+    spin_unlock(&devices->daemon_lock);
+  }
+}
+
+// Function called to mark a helper program daemon worker's command as done or failed and wake up
+//   the caller waiting for the command
+static void qnap_ec_misc_device_complete_daemon_command(struct qnap_ec_file_context* context,
+  enum qnap_ec_daemon_command_state state)
+{
+  // Declare and/or define needed variables
+  struct qnap_ec_devices* devices = context->devices;
+
+  // Get the daemon lock and check if a command is pending or running
+  spin_lock(&devices->daemon_lock);
+  if (context->daemon_command_state == qnap_ec_daemon_command_pending ||
+      context->daemon_command_state == qnap_ec_daemon_command_running)
+  {
+    // Set the command state and wake up the caller
+    context->daemon_command_state = state;
+    complete(&context->daemon_completion);
+  }
+  spin_unlock(&devices->daemon_lock);
+}
+
+// Function called when the miscellaneous device is memory mapped
+// Note: the whole shared memory command ring has to be mapped at offset zero
+static int qnap_ec_misc_device_mmap(struct file* file, struct vm_area_struct* vma)
+{
+  // Declare and/or define needed variables
+  struct qnap_ec_ring* ring;
+  struct qnap_ec_file_context* context = file->private_data;
+
+  // Check if the offset or the size is invalid
+  if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_ALIGN(sizeof(struct qnap_ec_ring)))
+    return -EINVAL;
+
+  // Get the context mutex lock and check if the ring has not been allocated yet and allocate zeroed
+  //   memory for it
+  // Note: the mutex makes sure concurrent calls don't both allocate a ring
+  mutex_lock(&context->mutex);
+  ring = context->ring;
+  if (ring == NULL)
+  {
+    ring = vmalloc_user(PAGE_ALIGN(sizeof(struct qnap_ec_ring)));
+    if (ring == NULL)
+    {
+      // Release the context mutex lock
+      mutex_unlock(&context->mutex);
+
+      return -ENOMEM;
+    }
+    context->ring_tail = 0;
+    smp_store_release(&context->ring, ring);
+  }
+
+  // Release the context mutex lock
+  mutex_unlock(&context->mutex);
+
+  // Map the ring into user space
+  return remap_vmalloc_range(vma, ring, 0);
+}
+
+// Function called when the miscellaneous device is released
+static int qnap_ec_misc_device_release(struct inode* inode, struct file* file)
+{
+  // Declare and/or define needed variables
+  bool is_daemon;
+  struct qnap_ec_file_context* context = file->private_data;
+  struct qnap_ec_devices* devices = context->devices;
+
+  // Check if this file is attached as a helper program daemon worker and detach the worker
+  spin_lock(&devices->daemon_lock);
+  is_daemon = qnap_ec_misc_device_detach_daemon(context);
+  spin_unlock(&devices->daemon_lock);
+
+  // Check if this file was attached as a helper program daemon worker and fail any pending or
+  //   running command so that the caller falls back to spawning the helper program
+  if (is_daemon)
+    qnap_ec_misc_device_complete_daemon_command(context, qnap_ec_daemon_command_failed);
+
+  // Release the file's reference to the context
+  kref_put(&context->refcount, &qnap_ec_misc_device_free_context);
+
+  return 0;
+}
+
+// Function called to free a miscellaneous device file context once the file has been released and
+//   the dispatcher is no longer using it
+static void qnap_ec_misc_device_free_context(struct kref* refcount)
+{
+  // Declare and/or define needed variables
+  struct qnap_ec_file_context* context = container_of(refcount, struct qnap_ec_file_context,
+    refcount);
+
+  // Release the opener's process ID and free the shared memory command ring memory and the context
+  //   memory
+  // Note: the ring can not be mapped at this point since a mapping holds a reference to the file
+  put_pid(context->pid);
+  vfree(context->ring);
+  kfree(context);
+}
+
 // Function called to exit the driver
 static void __exit qnap_ec_exit(void)
 {
@@ -1257,6 +3483,9 @@ static void __exit qnap_ec_exit(void)
   // Unregister the miscellaneous device
   misc_deregister(&qnap_ec_devices->misc_device);
 
+  // Cancel the helper program's timeout work in case it is still pending
+  cancel_delayed_work_sync(&qnap_ec_devices->spawn_timeout_work);
+
   // Free the devices structure memory
   kfree(qnap_ec_devices);
 